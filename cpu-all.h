@@ -874,6 +874,8 @@ typedef struct RAMBlock {
 #endif
     uint8_t *cline_track;
     ram_addr_t cline_track_size;
+    uint8_t **cline_sharers;
+    uint32_t *cline_epoch;	/* Per page, see mtrace_reset_cline_track */
 } RAMBlock;
 
 typedef struct RAMList {
@@ -991,6 +993,5 @@ void mtrace_inst_call(target_ulong target_pc, target_ulong return_pc,
 /* atomic instructions (e.g. lock; inc) */
 void mtrace_lock_start(CPUState *env);
 void mtrace_lock_stop(CPUState *env);
-void mtrace_inst_inc(void);
 
 #endif /* CPU_ALL_H */
@@ -58,6 +58,7 @@ int qemu_cpu_has_work(CPUState *env)
 
 void cpu_loop_exit(void)
 {
+    mtrace_tb_abort();
     env->current_tb = NULL;
     longjmp(env->jmp_env, 1);
 }
@@ -280,6 +281,10 @@ int cpu_exec(CPUState *env1)
 
     /* prepare setjmp context for exception handling */
     for(;;) {
+#if defined(TARGET_I386)
+        /* nothing is rewound yet for the TBs run from here on */
+        env->mtrace_insn_rewound = 0;
+#endif
         if (setjmp(env->jmp_env) == 0) {
 #if defined(__sparc__) && !defined(CONFIG_SOLARIS)
 #undef env
@@ -689,6 +694,8 @@ int cpu_exec(CPUState *env1)
 #error unsupported target CPU
 #endif
 
+    mtrace_cpu_exec_exit(env->cpu_index);
+
     /* restore global registers */
     barrier();
     env = (void *) saved_env_reg;
@@ -72,6 +72,7 @@ typedef struct TranslationBlock TranslationBlock;
 extern target_ulong gen_opc_pc[OPC_BUF_SIZE];
 extern uint8_t gen_opc_instr_start[OPC_BUF_SIZE];
 extern uint16_t gen_opc_icount[OPC_BUF_SIZE];
+extern uint16_t gen_opc_code_off[OPC_BUF_SIZE];
 
 #include "qemu-log.h"
 
@@ -86,6 +87,9 @@ int cpu_gen_code(CPUState *env, struct TranslationBlock *tb,
 int cpu_restore_state(struct TranslationBlock *tb,
                       CPUState *env, unsigned long searched_pc,
                       void *puc);
+target_ulong tb_pc_map_lookup(struct TranslationBlock *tb,
+                              unsigned long searched_pc, int *insn);
+int tb_find_insn(CPUState *env, struct TranslationBlock *tb, target_ulong pc);
 void cpu_resume_from_signal(CPUState *env1, void *puc);
 void cpu_io_recompile(CPUState *env, void *retaddr);
 TranslationBlock *tb_gen_code(CPUState *env, 
@@ -125,6 +129,13 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
 #define USE_DIRECT_JUMP
 #endif
 
+/* One entry per guest instruction: the offset of its host code from
+   tc_ptr and the offset of its guest PC from pc.  */
+typedef struct TBPCMapEntry {
+    uint16_t code_off;
+    uint16_t pc_off;
+} TBPCMapEntry;
+
 struct TranslationBlock {
     target_ulong pc;   /* simulated PC corresponding to this block (EIP + CS base) */
     target_ulong cs_base; /* CS base for this block */
@@ -158,6 +169,10 @@ struct TranslationBlock {
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
     uint32_t icount;
+    /* host code to guest PC map for mtrace, stored in code_gen_buffer
+       right after the code itself (NULL if not generated) */
+    TBPCMapEntry *pc_map;
+    uint16_t pc_map_len;
 };
 
 static inline unsigned int tb_jmp_cache_hash_page(target_ulong pc)
@@ -963,6 +963,8 @@ TranslationBlock *tb_gen_code(CPUState *env,
     tb->flags = flags;
     tb->cflags = cflags;
     cpu_gen_code(env, tb, &code_gen_size);
+    if (tb->pc_map)
+        code_gen_size = (uint8_t *)(tb->pc_map + tb->pc_map_len) - tc_ptr;
     code_gen_ptr = (void *)(((unsigned long)code_gen_ptr + code_gen_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
 
     /* check next page if needed */
@@ -2227,6 +2229,11 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
     env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te = &env->tlb_table[mmu_idx][index];
     te->addend = addend - vaddr;
+    if (mtrace_instrument_get() == mtrace_instrument_filter &&
+        ((pd & ~TARGET_PAGE_MASK) <= IO_MEM_ROM || (pd & IO_MEM_ROMD))) {
+        env->mtrace_cline_tlb[mmu_idx][index] =
+            mtrace_cline_tlb_addend((void *)addend);
+    }
     if (prot & PAGE_READ) {
         te->addr_read = address;
     } else {
@@ -2813,6 +2820,20 @@ static ram_addr_t last_ram_offset(void)
     return last;
 }
 
+/* This is used only by mtrace.  RAM blocks sorted by host address,
+   rebuilt on demand after a block is added or freed, plus the block
+   each CPU found last (usually main RAM). */
+static RAMBlock **ramblocks_by_host;
+static int nb_ramblocks_by_host;
+static RAMBlock *ramblock_from_host_hint[256];
+
+static void ramblock_from_host_invalidate(void)
+{
+    qemu_free(ramblocks_by_host);
+    ramblocks_by_host = NULL;
+    memset(ramblock_from_host_hint, 0, sizeof(ramblock_from_host_hint));
+}
+
 ram_addr_t qemu_ram_alloc_from_ptr(DeviceState *dev, const char *name,
                                    ram_addr_t size, void *host)
 {
@@ -2869,6 +2890,7 @@ ram_addr_t qemu_ram_alloc_from_ptr(DeviceState *dev, const char *name,
     new_block->length = size;
 
     QLIST_INSERT_HEAD(&ram_list.blocks, new_block, next);
+    ramblock_from_host_invalidate();
 
     ram_list.phys_dirty = qemu_realloc(ram_list.phys_dirty,
                                        last_ram_offset() >> TARGET_PAGE_BITS);
@@ -2893,6 +2915,8 @@ void qemu_ram_free(ram_addr_t addr)
     QLIST_FOREACH(block, &ram_list.blocks, next) {
         if (addr == block->offset) {
             QLIST_REMOVE(block, next);
+            ramblock_from_host_invalidate();
+            mtrace_cline_track_free(block);
             if (mem_path) {
 #if defined (__linux__) && !defined(TARGET_S390X)
                 if (block->fd) {
@@ -2901,7 +2925,6 @@ void qemu_ram_free(ram_addr_t addr)
                 } else {
                     qemu_vfree(block->host);
                 }
-		mtrace_cline_track_free(block);
 #endif
             } else {
 #if defined(TARGET_S390X) && defined(CONFIG_KVM)
@@ -2990,21 +3013,76 @@ ram_addr_t qemu_ram_addr_from_host_nofail(void *ptr)
 }
 
 /* This is used only by mtrace. */
-RAMBlock *qemu_ramblock_from_host(void *ptr)
+static int ramblock_host_cmp(const void *a, const void *b)
+{
+    const RAMBlock *ba = *(RAMBlock * const *)a;
+    const RAMBlock *bb = *(RAMBlock * const *)b;
+
+    if (ba->host < bb->host) {
+        return -1;
+    }
+    return ba->host > bb->host;
+}
+
+/* Like qemu_ramblock_from_host, but returns NULL if ptr isn't RAM. */
+static RAMBlock *ramblock_find_host(void *ptr)
 {
     RAMBlock *block;
     uint8_t *host = ptr;
+    int cpu = cpu_single_env ? cpu_single_env->cpu_index : 0;
+    int lo, hi, mid;
 
-    QLIST_FOREACH(block, &ram_list.blocks, next) {
-        if (host - block->host < block->length) {
-            return block;
+    block = ramblock_from_host_hint[cpu];
+    if (block && host - block->host < block->length) {
+        return block;
+    }
+
+    if (!ramblocks_by_host) {
+        nb_ramblocks_by_host = 0;
+        QLIST_FOREACH(block, &ram_list.blocks, next) {
+            nb_ramblocks_by_host++;
         }
+        ramblocks_by_host = qemu_malloc(nb_ramblocks_by_host *
+                                        sizeof(ramblocks_by_host[0]));
+        mid = 0;
+        QLIST_FOREACH(block, &ram_list.blocks, next) {
+            ramblocks_by_host[mid++] = block;
+        }
+        qsort(ramblocks_by_host, nb_ramblocks_by_host,
+              sizeof(ramblocks_by_host[0]), ramblock_host_cmp);
     }
 
-    fprintf(stderr, "mtrace: bad ram pointer %p\n", ptr);
-    abort();
+    /* Find the last block starting at or below host */
+    lo = 0;
+    hi = nb_ramblocks_by_host;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (ramblocks_by_host[mid]->host <= host) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return NULL;
+    }
+    block = ramblocks_by_host[lo - 1];
+    if (host - block->host >= block->length) {
+        return NULL;
+    }
+    ramblock_from_host_hint[cpu] = block;
+    return block;
+}
 
-    return 0;
+RAMBlock *qemu_ramblock_from_host(void *ptr)
+{
+    RAMBlock *block = ramblock_find_host(ptr);
+
+    if (!block) {
+        fprintf(stderr, "mtrace: bad ram pointer %p\n", ptr);
+        abort();
+    }
+    return block;
 }
 
 static uint32_t unassigned_mem_readb(void *opaque, target_phys_addr_t addr)
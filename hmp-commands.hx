@@ -1163,6 +1163,97 @@ STEXI
 @item mce @var{cpu} @var{bank} @var{status} @var{mcgstatus} @var{addr} @var{misc}
 @findex mce (x86)
 Inject an MCE on the given CPU (x86 only).
+ETEXI
+
+#if defined(TARGET_I386)
+
+    {
+        .name       = "mtrace_sample",
+        .args_type  = "value:i",
+        .params     = "rate",
+        .help       = "set mtrace to log one in every rate accesses",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_mtrace_sample,
+    },
+
+    {
+        .name       = "mtrace_quantum",
+        .args_type  = "value:i",
+        .params     = "blocks",
+        .help       = "set the number of blocks mtrace runs each CPU for before switching",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_mtrace_quantum,
+    },
+
+    {
+        .name       = "mtrace_calls",
+        .args_type  = "enable:b",
+        .params     = "on|off",
+        .help       = "enable or disable mtrace call tracing",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_mtrace_calls,
+    },
+
+    {
+        .name       = "mtrace_locks",
+        .args_type  = "enable:b",
+        .params     = "on|off",
+        .help       = "enable or disable mtrace lock tracing",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_mtrace_locks,
+    },
+
+    {
+        .name       = "mtrace_flush",
+        .args_type  = "",
+        .params     = "",
+        .help       = "write out everything mtrace has logged so far",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_mtrace_flush,
+    },
+
+    {
+        .name       = "mtrace_rotate",
+        .args_type  = "filename:F",
+        .params     = "filename",
+        .help       = "finish the mtrace log and continue in filename",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_mtrace_rotate,
+    },
+
+#endif
+STEXI
+@item mtrace_sample @var{rate}
+@findex mtrace_sample (x86)
+Log only one in every @var{rate} memory accesses, with the sampling mode
+set by @option{-mtrace-sample} (x86 only).
+ETEXI
+STEXI
+@item mtrace_quantum @var{blocks}
+@findex mtrace_quantum (x86)
+Run each CPU for @var{blocks} translation blocks before switching to the
+next, or set the round-robin default with 0 (x86 only).
+ETEXI
+STEXI
+@item mtrace_calls on|off
+@findex mtrace_calls (x86)
+Enable or disable tracing calls and returns (x86 only).
+ETEXI
+STEXI
+@item mtrace_locks on|off
+@findex mtrace_locks (x86)
+Enable or disable tracing locked accesses (x86 only).
+ETEXI
+STEXI
+@item mtrace_flush
+@findex mtrace_flush (x86)
+Wait until every entry mtrace has logged so far is in the log file (x86 only).
+ETEXI
+STEXI
+@item mtrace_rotate @var{filename}
+@findex mtrace_rotate (x86)
+Write out and close the mtrace log, and continue logging to @var{filename}.
+The new log starts with its own machine entry and call stacks (x86 only).
 ETEXI
 
     {
@@ -57,6 +57,7 @@
 #include "json-parser.h"
 #include "osdep.h"
 #include "exec-all.h"
+#include "mtrace.h"
 #ifdef CONFIG_SIMPLE_TRACE
 #include "trace.h"
 #endif
@@ -3036,6 +3037,16 @@ static const mon_cmd_t info_cmds[] = {
         .user_print = do_info_uuid_print,
         .mhandler.info_new = do_info_uuid,
     },
+#if defined(TARGET_I386)
+    {
+        .name       = "mtrace",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show mtrace settings and statistics",
+        .user_print = do_info_mtrace_print,
+        .mhandler.info_new = do_info_mtrace,
+    },
+#endif
 #if defined(TARGET_PPC)
     {
         .name       = "cpustats",
@@ -3233,6 +3244,16 @@ static const mon_cmd_t qmp_query_cmds[] = {
         .user_print = do_info_uuid_print,
         .mhandler.info_new = do_info_uuid,
     },
+#if defined(TARGET_I386)
+    {
+        .name       = "mtrace",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show mtrace settings and statistics",
+        .user_print = do_info_mtrace_print,
+        .mhandler.info_new = do_info_mtrace,
+    },
+#endif
     {
         .name       = "migrate",
         .args_type  = "",
@@ -3,6 +3,8 @@
 
 enum {
     MTRACE_ENTRY_REGISTER = 1,
+    MTRACE_RING_REGISTER,	/* Register this CPU's mtrace_guest_ring */
+    MTRACE_RING_FLUSH,		/* This CPU's mtrace_guest_ring is full */
 };
 
 typedef enum {
@@ -24,6 +26,11 @@ typedef enum {
     mtrace_entry_gc,
     mtrace_entry_gcepoch,
 
+    mtrace_entry_string,	/* interned name (MTRACE_FORMAT_V3) */
+    mtrace_entry_stack,		/* call stack definition (MTRACE_FORMAT_V4) */
+    mtrace_entry_cline,		/* mtrace_record_aggregate summary */
+    mtrace_entry_stats,		/* recorder counters, ends the log */
+
     mtrace_entry_num		/* NB actually num + 1 */
 } mtrace_entry_t;
 
@@ -44,8 +51,24 @@ typedef enum {
 
     mtrace_disable_count_cpu,
     mtrace_enable_count_cpu,
+
+    mtrace_filter_all_cpu,
 } mtrace_host_t;
 
+/*
+ * Rules for mtrace_filter_all_cpu.  Once there is any rule, only
+ * accesses that match one of them are logged.  Label rules match the
+ * objects labeled after the rule is added, until they're freed (a label
+ * with 0 bytes).
+ */
+typedef enum {
+    mtrace_filter_clear = 0,	/* Drop every rule */
+    mtrace_filter_virt,		/* Guest virtual addresses [start, end) */
+    mtrace_filter_phys,		/* Guest physical RAM [start, end) */
+    mtrace_filter_label_type,	/* Objects labeled with label_type */
+    mtrace_filter_label_name,	/* Objects labeled str */
+} mtrace_filter_t;
+
 typedef enum {
     /* Don't record accesses. */
     mtrace_record_disable = 0,
@@ -60,6 +83,10 @@ typedef enum {
 
     /* Like mtrace_record_ascope, but record iff in kernel mode. */
     mtrace_record_kernelscope,
+
+    /* Count reads and writes per cache line and CPU, and log only an
+     * mtrace_cline_entry for each when recording stops. */
+    mtrace_record_aggregate,
 } mtrace_record_mode_t;
 
 #define __pack__ __attribute__((__packed__))
@@ -149,6 +176,19 @@ struct mtrace_host_entry {
 	struct {
 	    uint64_t cpu;
 	} call;
+
+	/* Add an access filter rule */
+	struct {
+	    mtrace_filter_t type;
+	    union {
+		struct {
+		    uint64_t start;
+		    uint64_t end;
+		};
+		mtrace_label_t label_type;
+		char str[64];
+	    };
+	} __pack__ filter;
     };
 } __pack__;
 
@@ -177,6 +217,18 @@ typedef enum {
     mtrace_access_iw,	/* IO Write, which is actually to RAM */
 } mtrace_access_t;
 
+/*
+ * What the simulated private cache (-mtrace-cache) made of an access.
+ * cache_cpu is the CPU whose cache supplied or lost the line in a
+ * coherence miss, or whose store invalidated this CPU's copy.
+ */
+typedef enum {
+    mtrace_cache_none = 0,	/* No cache model */
+    mtrace_cache_hit,
+    mtrace_cache_miss,		/* Cold or capacity miss */
+    mtrace_cache_coherence,	/* Another CPU had or took the line */
+} mtrace_cache_t;
+
 struct mtrace_access_entry {
     struct mtrace_entry_header h;
 
@@ -184,12 +236,72 @@ struct mtrace_access_entry {
     uint8_t traffic:1;
     uint8_t lock:1;
     uint8_t deps:1;
+    uint8_t cache:2;		/* mtrace_cache_t */
     uint64_t pc;
     uint64_t host_addr;
     uint64_t guest_addr;
     uint8_t bytes;
+    uint32_t stack_id;		/* See mtrace_stack_entry */
+    uint16_t cache_cpu;
 }__pack__;
 
+/*
+ * Log format versions, from mtrace_machine_entry.format.  Logs whose
+ * machine entry predates the format field are MTRACE_FORMAT_V1, where
+ * every entry is one of the structs in this file.
+ *
+ * MTRACE_FORMAT_V2 logs may also contain compact access records, which
+ * start with a tag byte that has MTRACE_COMPACT_TAG set (so it can't
+ * be the first byte of an mtrace_entry_t).  After the tag come:
+ *   - if MTRACE_COMPACT_CPU, the cpu as a varint, otherwise the cpu
+ *     is that of the previous access
+ *   - if MTRACE_COMPACT_COUNT, the access_count as a zigzag varint
+ *     difference from the implicit one, which is one more than the
+ *     previous access's
+ *   - pc, host_addr and guest_addr as zigzag varint differences from
+ *     the previous access on the same cpu
+ *   - bytes
+ * Varints are little-endian base 128 and ts is 0.  stack_id is that
+ * of the previous access on the same cpu; the writer logs a full entry
+ * when it changes.  Before the first access the cpu, addresses, stack
+ * id and implicit access_count are all 0, and full access entries
+ * update this state just like compact ones.
+ *
+ * In MTRACE_FORMAT_V5 logs, access entries' ts is the number of
+ * instructions the cpu has started, and compact access records carry it
+ * as a zigzag varint difference from the previous access on the same
+ * cpu, right after guest_addr.
+ *
+ * In MTRACE_FORMAT_V6 logs whose machine entry has a cache model
+ * (cache_ways != 0), compact access records end with cache | cache_cpu
+ * << 2 as a varint.  Otherwise, the writer logs a full entry for any
+ * access with a cache result.
+ */
+#define MTRACE_FORMAT_V1	1
+#define MTRACE_FORMAT_V2	2
+#define MTRACE_FORMAT_V3	3
+#define MTRACE_FORMAT_V4	4
+#define MTRACE_FORMAT_V5	5
+#define MTRACE_FORMAT_V6	6
+
+#define MTRACE_COMPACT_TAG	0x80
+#define MTRACE_COMPACT_TYPE	0x03	/* mtrace_access_t */
+#define MTRACE_COMPACT_TRAFFIC	0x04
+#define MTRACE_COMPACT_LOCK	0x08
+#define MTRACE_COMPACT_DEPS	0x10
+#define MTRACE_COMPACT_CPU	0x20
+#define MTRACE_COMPACT_COUNT	0x40
+
+/*
+ * MTRACE_FORMAT_V3 logs also intern the char[64] names of label,
+ * lock, task, ascope, avar and gc entries.  The first time the writer
+ * sees a name it logs an mtrace_string_entry that assigns the name an
+ * id (counting up from 1).  Entries carrying that name then have
+ * MTRACE_ENTRY_INTERNED set in h.type and a uint32_t id in place of
+ * the name, with h.size reduced to match.
+ */
+#define MTRACE_ENTRY_INTERNED	0x40
+
 /*
  * A guest lock acquire/release
  */
@@ -236,6 +348,17 @@ struct mtrace_sched_entry {
     uint64_t tid;
 } __pack__;;
 
+/*
+ * How the host picks 1 in every mtrace_machine_entry.sample accesses.
+ * Each CPU samples on its own.
+ */
+typedef enum {
+    mtrace_sample_count = 0,	/* Every sample-th access */
+    mtrace_sample_random,	/* Geometrically distributed gaps */
+    mtrace_sample_line,		/* All or none of each line, by a hash */
+    mtrace_sample_burst,	/* Runs of sample_burst instructions */
+} mtrace_sample_t;
+
 /*
  * The QEMU guest machine info
  */
@@ -248,6 +371,12 @@ struct mtrace_machine_entry {
     uint64_t sample;
     uint8_t  locked:1;
     uint8_t  calls:1;
+    uint8_t  format;		/* MTRACE_FORMAT_* */
+    uint8_t  cline_shift;	/* log2 of the tracking granularity */
+    uint64_t cache_size;	/* Per-CPU cache model, or 0 */
+    uint8_t  cache_ways;
+    uint8_t  sample_mode;	/* mtrace_sample_t */
+    uint64_t sample_burst;
 } __pack__;
 
 /*
@@ -298,6 +427,71 @@ struct mtrace_gcepoch_entry {
     uint8_t begin:1;
 } __pack__;
 
+/*
+ * With call tracing in MTRACE_FORMAT_V4, the host follows calls and
+ * returns on a shadow of each fcall stack instead of logging them, and
+ * access entries carry the id of the call stack they ran on.  Stack id
+ * 0 is the empty stack, and the host logs one of these the first time
+ * a stack appears: stack id is stack parent with a call to target_pc
+ * pushed on top.
+ */
+struct mtrace_stack_entry {
+    struct mtrace_entry_header h;
+    uint32_t id;
+    uint32_t parent;
+    uint64_t target_pc;
+    uint64_t return_pc;
+} __pack__;
+
+/*
+ * What one CPU did to one cache line while recording in
+ * mtrace_record_aggregate mode.  guest_addr and pc are from the CPU's
+ * first access to the line.
+ */
+struct mtrace_cline_entry {
+    struct mtrace_entry_header h;
+
+    uint64_t host_addr;		/* Start of the line */
+    uint64_t guest_addr;
+    uint64_t pc;
+    uint64_t reads;
+    uint64_t writes;		/* Including iw */
+} __pack__;
+
+/*
+ * The recorder's own counters, summed over CPUs, logged at the end of
+ * each log file.  bytes_in, bytes_out and write_ns are as of when the
+ * writer got to this entry, so they leave out the entry itself.
+ */
+#define MTRACE_STATS_TYPES	24
+
+struct mtrace_stats_entry {
+    struct mtrace_entry_header h;
+
+    uint64_t entries[MTRACE_STATS_TYPES];	/* By mtrace_entry_t */
+    uint64_t sample_drops;	/* Accesses skipped by -mtrace-sample */
+    uint64_t get_pc;		/* Guest PC lookups for access entries */
+    uint64_t get_pc_slow;	/* ... that retranslated the TB */
+    uint64_t rw_debug;		/* Guest entries read by cpu_memory_rw_debug */
+    uint64_t ring_stalls;	/* Times the guest waited for the writer */
+    uint64_t ring_stall_ns;
+    uint64_t bytes_in;		/* Encoded log, before compression */
+    uint64_t bytes_out;		/* Written to the log file */
+    uint64_t write_ns;		/* Time blocked writing the log file */
+    uint64_t filter_drops;	/* Accesses skipped by -mtrace-filter */
+    uint64_t cache[4];		/* Cache model results by mtrace_cache_t */
+} __pack__;
+
+/*
+ * A name interned by the host.  Only h.size bytes are logged, so str
+ * is NUL-terminated unless the name is the full 64 bytes.
+ */
+struct mtrace_string_entry {
+    struct mtrace_entry_header h;
+    uint32_t id;
+    char str[64];
+} __pack__;
+
 
 union mtrace_entry {
     struct mtrace_entry_header h;
@@ -317,8 +511,60 @@ union mtrace_entry {
     struct mtrace_avar_entry avar;
     struct mtrace_gc_entry gc;
     struct mtrace_gcepoch_entry gcepoch;
+    struct mtrace_string_entry name;
+    struct mtrace_stack_entry stack;
+    struct mtrace_cline_entry cline;
+    struct mtrace_stats_entry stats;
+} __pack__;
+
+/*
+ * A per-CPU ring of entries in guest memory, so the guest can log
+ * entries with plain stores instead of trapping on every one.  The
+ * guest zeroes the ring and passes its address and the size of buf (a
+ * power of two) to MTRACE_RING_REGISTER; the host sets size if it
+ * accepted the ring, which must be physically contiguous.  head and
+ * tail are byte counts that only grow.  The guest writes an entry,
+ * with h.type and h.size filled in and padded to 8 bytes, at tail and
+ * the host consumes entries from head.  An h.type of 0 means skip to
+ * the start of buf.
+ *
+ * The host drains a CPU's ring before it logs anything else for that
+ * CPU, every ring before it logs an access, and a CPU's ring when it
+ * switches to another CPU, and stamps the entries with the access_count
+ * at that point.
+ * Host entries need synchronous handling, so they must still go
+ * through MTRACE_ENTRY_REGISTER, which also drains every ring first.
+ * So must labels on user addresses, since the host translates
+ * guest_addr when it drains the ring, possibly after a context switch.
+ */
+struct mtrace_guest_ring {
+    volatile uint64_t head;
+    volatile uint64_t tail;
+    volatile uint64_t size;
+    char buf[0];
 } __pack__;
 
+/* Offset of the char[64] name in entries of type, or 0 if they have none */
+static inline unsigned int mtrace_entry_name_offset(unsigned long type)
+{
+    switch (type) {
+    case mtrace_entry_label:
+	return __builtin_offsetof(struct mtrace_label_entry, str);
+    case mtrace_entry_lock:
+	return __builtin_offsetof(struct mtrace_lock_entry, str);
+    case mtrace_entry_task:
+	return __builtin_offsetof(struct mtrace_task_entry, str);
+    case mtrace_entry_ascope:
+	return __builtin_offsetof(struct mtrace_ascope_entry, name);
+    case mtrace_entry_avar:
+	return __builtin_offsetof(struct mtrace_avar_entry, name);
+    case mtrace_entry_gc:
+	return __builtin_offsetof(struct mtrace_gc_entry, name);
+    default:
+	return 0;
+    }
+}
+
 #ifndef QEMU_MTRACE
 
 #ifndef PIN_MTRACE
@@ -342,10 +588,71 @@ void mtrace_magic(unsigned long a0, unsigned long a1,
     __attribute__((noinline));
 #endif
 
+static inline void mtrace_ring_register(struct mtrace_guest_ring *ring,
+					unsigned long size)
+{
+    ring->head = ring->tail = ring->size = 0;
+    mtrace_magic(MTRACE_RING_REGISTER, (unsigned long)ring, size, 0, 0, 0);
+}
+
+/*
+ * Append an entry to ring, which must belong to the current CPU and
+ * not be appended to concurrently (e.g. from an interrupt).  Returns 0
+ * if the host didn't accept the ring.
+ */
+static inline int mtrace_ring_append(struct mtrace_guest_ring *ring,
+				     volatile struct mtrace_entry_header *h,
+				     unsigned long type, unsigned long len)
+{
+    unsigned long need = (len + 7) & ~7UL;
+    uint64_t off, contig;
+
+    if (ring == 0 || ring->size == 0 || need > ring->size)
+	return 0;
+
+    for (;;) {
+	off = ring->tail & (ring->size - 1);
+	contig = ring->size - off;
+	if (ring->size - (ring->tail - ring->head) >=
+	    need + (contig < need ? contig : 0))
+	    break;
+	mtrace_magic(MTRACE_RING_FLUSH, 0, 0, 0, 0, 0);
+    }
+
+    if (contig < need) {
+	*(volatile uint32_t *)&ring->buf[off] = 0;
+	ring->tail += contig;
+	off = 0;
+    }
+    h->type = (mtrace_entry_t)type;
+    h->size = len;
+    __builtin_memcpy(&ring->buf[off], (const void *)h, len);
+    __asm __volatile("" ::: "memory");
+    ring->tail += need;
+    return 1;
+}
+
+/*
+ * Guests that register rings define mtrace_ring_current() to return
+ * the current CPU's ring (or 0), and entries other than host entries
+ * and labels below MTRACE_RING_KERNEL_BASE then go through the ring.
+ */
+#ifndef MTRACE_RING_KERNEL_BASE
+#define MTRACE_RING_KERNEL_BASE	0xffff800000000000ULL
+#endif
+
 static inline void mtrace_entry_register(volatile struct mtrace_entry_header *h,
 					 unsigned long type,
 					 unsigned long len)
 {
+#ifdef mtrace_ring_current
+    if (type != mtrace_entry_host &&
+	(type != mtrace_entry_label ||
+	 ((volatile struct mtrace_label_entry *)h)->guest_addr >=
+	 MTRACE_RING_KERNEL_BASE) &&
+	mtrace_ring_append(mtrace_ring_current(), h, type, len))
+	return;
+#endif
     mtrace_magic(MTRACE_ENTRY_REGISTER, (unsigned long)h,
 		 type, len, 0, 0);
 }
@@ -388,6 +695,48 @@ static inline void mtrace_disable_count(void)
     mtrace_entry_register(&entry.h, mtrace_entry_host, sizeof(entry));
 }
 
+static inline void mtrace_filter_range(mtrace_filter_t type,
+				       uint64_t start, uint64_t end)
+{
+    volatile struct mtrace_host_entry entry;
+
+    entry.host_type = mtrace_filter_all_cpu;
+    entry.filter.type = type;
+    entry.filter.start = start;
+    entry.filter.end = end;
+    mtrace_entry_register(&entry.h, mtrace_entry_host, sizeof(entry));
+}
+
+static inline void mtrace_filter_label(mtrace_label_t label_type)
+{
+    volatile struct mtrace_host_entry entry;
+
+    entry.host_type = mtrace_filter_all_cpu;
+    entry.filter.type = mtrace_filter_label_type;
+    entry.filter.label_type = label_type;
+    mtrace_entry_register(&entry.h, mtrace_entry_host, sizeof(entry));
+}
+
+static inline void mtrace_filter_name(const char *str)
+{
+    volatile struct mtrace_host_entry entry;
+
+    entry.host_type = mtrace_filter_all_cpu;
+    entry.filter.type = mtrace_filter_label_name;
+    strncpy((char*)entry.filter.str, str, sizeof(entry.filter.str));
+    entry.filter.str[sizeof(entry.filter.str) - 1] = 0;
+    mtrace_entry_register(&entry.h, mtrace_entry_host, sizeof(entry));
+}
+
+static inline void mtrace_filter_reset(void)
+{
+    volatile struct mtrace_host_entry entry;
+
+    entry.host_type = mtrace_filter_all_cpu;
+    entry.filter.type = mtrace_filter_clear;
+    mtrace_entry_register(&entry.h, mtrace_entry_host, sizeof(entry));
+}
+
 static inline void mtrace_label_register(mtrace_label_t type,
 					 const void * addr, 
 					 unsigned long bytes, 
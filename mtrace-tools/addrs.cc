@@ -24,28 +24,26 @@ extern "C" {
 // ObjectAddrStat
 //
 void
-ObjectAddrStat::init(const MtraceObject* object,
-                     const struct mtrace_access_entry* a)
+ObjectAddrStat::init(const MtraceObject* object, guest_addr_t addr)
 {
-    name = object->name_;
+    name = *object->name_;
     base = object->guest_addr_;
-    address = a->guest_addr;
-    add(a);
+    address = addr;
 }
 
 void
-ObjectAddrStat::add(const struct mtrace_access_entry* a)
+ObjectAddrStat::add(int cpu, pc_t pc, uint64_t count)
 {
     {
-        auto it = per_pc.find(a->pc);
+        auto it = per_pc.find(pc);
         if (it == per_pc.end())
-            per_pc[a->pc] = 1;
+            per_pc[pc] = count;
         else
-            it->second++;
+            it->second += count;
     }
-    if (per_cpu.size() < (unsigned)a->h.cpu+1)
-        per_cpu.resize(a->h.cpu+1);
-    per_cpu[a->h.cpu]++;
+    if (per_cpu.size() < (unsigned)cpu+1)
+        per_cpu.resize(cpu+1);
+    per_cpu[cpu] += count;
 }
 
 JsonDict*
@@ -90,21 +88,35 @@ SharedAddresses::handle(const union mtrace_entry* entry)
 {
     MtraceObject object;
     ObjectAddrKey key;
-
-    if (entry->h.type != mtrace_entry_access)
+    uint64_t count;
+    pc_t pc;
+
+    // Line summaries from mtrace_record_aggregate count every access
+    // to the line at the address and PC of the first one
+    if (entry->h.type == mtrace_entry_access) {
+        key.addr = entry->access.guest_addr;
+        pc = entry->access.pc;
+        count = 1;
+    } else if (entry->h.type == mtrace_entry_cline) {
+        key.addr = entry->cline.guest_addr;
+        pc = entry->cline.pc;
+        count = entry->cline.reads + entry->cline.writes;
+    } else {
         die("SharedAddresses::handle");
+    }
 
-    const struct mtrace_access_entry* a = &entry->access;
     key.obj_id = 0;
-    if (mtrace_label_map.object(a->guest_addr, object))
+    if (mtrace_label_map.object(key.addr, object))
         key.obj_id = object.id_;
-    key.addr = a->guest_addr;
 
     auto it = stat_.find(key);
-    if (it == stat_.end())
-        stat_[key].init(&object, a);
-    else
-        it->second.add(a);
+    if (it == stat_.end()) {
+        ObjectAddrStat& stat = stat_[key];
+        stat.init(&object, key.addr);
+        stat.add(entry->h.cpu, pc, count);
+    } else {
+        it->second.add(entry->h.cpu, pc, count);
+    }
 }
 
 void
@@ -29,8 +29,8 @@ struct ObjectAddrHash {
 };
 
 struct ObjectAddrStat {
-    void init(const MtraceObject* object, const struct mtrace_access_entry* a);
-    void add(const struct mtrace_access_entry* a);
+    void init(const MtraceObject* object, guest_addr_t addr);
+    void add(int cpu, pc_t pc, uint64_t count);
     JsonDict* to_json(void);
 
     string name;
@@ -18,21 +18,23 @@ struct AccessSetCount {
     std::map<uint64_t, uint64_t> readcount_;
     std::map<uint64_t, uint64_t> writecount_;
 
-    void add_access(const PhysicalAccess& pa, mtrace_access_t acctype) {
+    void add_access(const PhysicalAccess& pa, mtrace_access_t acctype,
+                    uint64_t count = 1) {
         // assume PhysicalAccess'es do not span cache lines
-        uint64_t addr = pa.access / 64 * 64;  // cacheline
+        uint64_t addr = pa.access >> mtrace_summary.cline_shift
+                        << mtrace_summary.cline_shift;  // cacheline
 
         switch (acctype) {
         case mtrace_access_st:
         case mtrace_access_iw:
-            writecount_[addr]++;
+            writecount_[addr] += count;
             if (write_.count(addr) == 0)
                 write_[addr] = new std::set<PhysicalAccess>();
             write_[addr]->insert(pa);
             break;
 
         case mtrace_access_ld:
-            readcount_[addr]++;
+            readcount_[addr] += count;
             if (read_.count(addr) == 0)
                 read_[addr] = new std::set<PhysicalAccess>();
             read_[addr]->insert(pa);
@@ -52,7 +54,8 @@ public:
         switch (entry->h.type) {
         case mtrace_entry_host:
             if (entry->host.host_type == mtrace_access_all_cpu) {
-                if (entry->host.access.mode == mtrace_record_ascope) {
+                if (entry->host.access.mode == mtrace_record_ascope ||
+                    entry->host.access.mode == mtrace_record_aggregate) {
                     active_ = true;
                 }
 
@@ -67,18 +70,39 @@ public:
                 handle(&entry->access);
             break;
 
+        case mtrace_entry_cline:
+            // Logged just before the entry that disables aggregation
+            if (active_)
+                handle(&entry->cline);
+            break;
+
         default:
             break;
         }
     }
 
     void handle(const mtrace_access_entry* entry) {
-        int cpu = entry->h.cpu;
+        PhysicalAccess pa = physical_access(entry->guest_addr, entry->pc,
+                                            entry->bytes);
+        add_access(entry->h.cpu, pa, entry->access_type, 1);
+    }
 
+    // A line summary stands in for all the CPU's accesses to the line,
+    // at the address and PC of its first access
+    void handle(const mtrace_cline_entry* entry) {
+        PhysicalAccess pa = physical_access(entry->guest_addr, entry->pc, 0);
+        if (entry->reads)
+            add_access(entry->h.cpu, pa, mtrace_access_ld, entry->reads);
+        if (entry->writes)
+            add_access(entry->h.cpu, pa, mtrace_access_st, entry->writes);
+    }
+
+    PhysicalAccess physical_access(uint64_t guest_addr, uint64_t pc,
+                                   uint8_t size) {
         PhysicalAccess pa;
-        pa.access = entry->guest_addr;
-        pa.pc = entry->pc;
-        pa.size = entry->bytes;
+        pa.access = guest_addr;
+        pa.pc = pc;
+        pa.size = size;
         pa.stack = 0;
 
         MtraceObject obj;
@@ -88,12 +112,16 @@ public:
         } else {
             pa.base = 0;
         }
+        return pa;
+    }
 
+    void add_access(int cpu, const PhysicalAccess& pa,
+                    mtrace_access_t acctype, uint64_t count) {
         if (cpuacc_.count(cpu) == 0)
             cpuacc_[cpu] = AccessSetCount();
 
-        cpuacc_[cpu].add_access(pa, entry->access_type);
-        allacc_.add_access(pa, entry->access_type);
+        cpuacc_[cpu].add_access(pa, acctype, count);
+        allacc_.add_access(pa, acctype, count);
     }
 
     virtual void exit(JsonDict *json_file) {
@@ -87,7 +87,7 @@ public:
                         sharing.push_back(make_pair(&s1, &s2));
                     } else if (abstract_sharing && !concrete_sharing) {
                         fprintf(stderr, "Warning: Abstract sharing without concrete sharing: %s and %s (%s)\n",
-                                s1.name_.c_str(), s2.name_.c_str(), abstract_sharing->c_str());
+                                s1.name_->c_str(), s2.name_->c_str(), abstract_sharing->c_str());
                     }
                 }
             }
@@ -135,8 +135,8 @@ public:
 
                     if (abstract_sharing && concrete_sharing) {
                         JsonDict *od = JsonDict::create();
-                        od->put("s1", s1.name_);
-                        od->put("s2", s2.name_);
+                        od->put("s1", *s1.name_);
+                        od->put("s2", *s2.name_);
                         auto bytes = 
                             shared_amount(s1.read_.begin(),  s1.read_.end(),
                                           s1.write_.begin(), s1.write_.end(),
@@ -185,7 +185,7 @@ public:
             json_file->put("abstract-scopes", lst, false);
             for (auto &ascope : scopes_) {
                 JsonDict *od = JsonDict::create();
-                od->put("name", ascope.name_);
+                od->put("name", *ascope.name_);
                 od->put("aread", JsonList::create(ascope.aread_.begin(), ascope.aread_.end()));
                 od->put("awrite", JsonList::create(ascope.awrite_.begin(), ascope.awrite_.end()));
 
@@ -217,8 +217,8 @@ public:
                 const Ascope &s2 = *it.second;
 
                 JsonDict *od = JsonDict::create();
-                od->put("s1", s1.name_);
-                od->put("s2", s2.name_);
+                od->put("s1", *s1.name_);
+                od->put("s2", *s2.name_);
                 JsonList *shared = JsonList::create();
                 int count = 0;
                 shared_to_json(shared, &count, "rw",
@@ -239,7 +239,7 @@ public:
 
     class Ascope {
     public:
-        Ascope(string name, int cpu)
+        Ascope(const string* name, int cpu)
             : name_(name), cpu_set_(1 << cpu) { }
 
         void add_cpu(int cpu)
@@ -247,7 +247,7 @@ public:
             cpu_set_ |= 1 << cpu;
         }
 
-        string name_;
+        const string* name_;
         uint64_t cpu_set_;
         set<string> aread_;
         set<string> awrite_;
@@ -292,7 +292,8 @@ private:
             if (ascope->exit)
                 pop();
             else
-                stack_.emplace_back(ascope->name, ascope->h.cpu);
+                stack_.emplace_back(mtrace_strings.entry_name(ascope->name),
+                                    ascope->h.cpu);
         }
 
         void handle(const mtrace_avar_entry *avar)
@@ -303,7 +304,7 @@ private:
 	    }
 
             Ascope *cur = &stack_.back();
-            string var = avar->name;
+            const string& var = *mtrace_strings.entry_name(avar->name);
             if (avar->write) {
                 cur->awrite_.insert(var);
                 cur->aread_.erase(var);
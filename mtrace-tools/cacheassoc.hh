@@ -19,7 +19,8 @@ struct CacheSet {
     void add_access(const PhysicalAccess& pa) {
         bool cached = false;
         for (uint64_t x: cached_)
-            if (x / 64 == pa.access / 64)
+            if (x >> mtrace_summary.cline_shift ==
+                pa.access >> mtrace_summary.cline_shift)
                 cached = true;
 
         if (!cached) {
@@ -59,7 +60,7 @@ public:
             pa.base = 0;
         }
 
-        uint64_t set = (pa.access / 64) % nsets_;
+        uint64_t set = (pa.access >> mtrace_summary.cline_shift) % nsets_;
         set_[set].add_access(pa);
     }
 
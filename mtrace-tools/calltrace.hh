@@ -57,6 +57,22 @@ private:
     CallStack(const struct mtrace_fcall_entry* e)
     : tag_(e->tag) {}
 
+    // A logged stack (MTRACE_FORMAT_V4): parent with one call pushed
+    CallStack(const CallStack* parent, const struct mtrace_stack_entry* e)
+        : tag_(0) {
+        struct mtrace_call_entry call;
+
+        if (parent)
+            stack_ = parent->stack_;
+        memset(&call, 0, sizeof(call));
+        call.h.type = mtrace_entry_call;
+        call.h.size = sizeof(call);
+        call.h.cpu = e->h.cpu;
+        call.target_pc = e->target_pc;
+        call.return_pc = e->return_pc;
+        stack_.push_front(call);
+    }
+
     void push(const struct mtrace_call_entry* e) {
         stack_.push_front(*e);
     }
@@ -87,29 +103,41 @@ namespace std {
 }
 
 //
-// Provides the current call stack via current(cpu)
+// Provides the current call stack via current(cpu).  Logs in
+// MTRACE_FORMAT_V4 name each access's stack by id instead of replaying
+// calls and returns, so this must see accesses before other handlers.
 //
 class CallTrace : public EntryHandler {
 public:
     // CallStack used to be a nested class
     typedef ::CallStack CallStack;
 
+    CallTrace(void) : current_(), current_id_(), stacks_(1, nullptr) {}
+
     virtual void handle(const union mtrace_entry* entry) {
         if (entry->h.type == mtrace_entry_call)
             handle(&entry->call, entry->h.cpu);
         else if (entry->h.type == mtrace_entry_fcall)
             handle(&entry->fcall, entry->h.cpu);
+        else if (entry->h.type == mtrace_entry_stack)
+            handle(&entry->stack);
+        else if (entry->h.type == mtrace_entry_access)
+            current_id_[entry->h.cpu] = entry->access.stack_id;
         else
             die("CallTrace::handle: unexpected");
     }
 
     CallStack* new_current(int cpu) const {
+        if (current_id_[cpu])
+            return new CallStack(*stacks_[current_id_[cpu]]);
         if (current_[cpu] && !current_[cpu]->stack_.empty())
             return new CallStack(*current_[cpu]);
         return NULL;
     }
 
     const CallStack *get_current(int cpu) const {
+        if (current_id_[cpu])
+            return stacks_[current_id_[cpu]];
         if (current_[cpu] && !current_[cpu]->stack_.empty())
             return &*cache_.insert(*current_[cpu]).first;
         return NULL;
@@ -153,6 +181,15 @@ private:
         }
     }
 
+    void handle(const struct mtrace_stack_entry* e) {
+        // Each segment of the log repeats the stacks defined so far
+        if (e->id < stacks_.size())
+            return;
+        if (e->id != stacks_.size() || e->parent >= stacks_.size())
+            die("CallTrace::handle: bad stack %u", e->id);
+        stacks_.push_back(new CallStack(stacks_[e->parent], e));
+    }
+
     void handle(const struct mtrace_call_entry* e, int cpu) {
         CallStack* cs;
 
@@ -167,7 +204,9 @@ private:
     }
 
     CallStack*                      current_[MAX_CPUS];
+    uint32_t                        current_id_[MAX_CPUS];
     map<uint64_t, CallStack*>       call_stack_;
+    vector<const CallStack*>        stacks_;
     mutable std::unordered_set<CallStack> cache_;
 };
 
@@ -11,10 +11,10 @@
 #include "physaccess.hh"
 #include <dwarf++.hh>
 
-class GcObject {
+struct GcObject {
     uint64_t base;
     uint64_t nbytes;
-    char name[64];
+    const string* name;
 };
 
 class CheckGC : public EntryHandler {
@@ -62,7 +62,7 @@ private:
             return;
 
         it--;
-        mtrace_gc_entry& gcentry = it->second;
+        GcObject& gcentry = it->second;
         if (entry->guest_addr >= gcentry.base + gcentry.nbytes)
             return;
 
@@ -89,13 +89,18 @@ private:
         r->put("access", pa.to_json());
         r->put("object_base", gcentry.base);
         r->put("object_bytes", gcentry.nbytes);
-        if (reports_by_type_.count(gcentry.name) == 0)
-            reports_by_type_[gcentry.name] = JsonList::create();
-        reports_by_type_[gcentry.name]->append(r);
+        auto report = reports_by_type_.find(*gcentry.name);
+        if (report == reports_by_type_.end())
+            report = reports_by_type_.insert(
+                make_pair(*gcentry.name, JsonList::create())).first;
+        report->second->append(r);
     }
 
     void handle(const mtrace_gc_entry* entry) {
-        objects_[entry->base] = *entry;
+        GcObject& o = objects_[entry->base];
+        o.base = entry->base;
+        o.nbytes = entry->nbytes;
+        o.name = mtrace_strings.entry_name(entry->name);
     }
 
     void handle(const mtrace_gcepoch_entry* entry) {
@@ -105,6 +110,6 @@ private:
 
     bool active_;
     std::map<tid_t, bool> epoch_held_;
-    std::map<uint64_t, mtrace_gc_entry> objects_;
+    std::map<uint64_t, GcObject> objects_;
     std::map<std::string, JsonList*> reports_by_type_;
 };
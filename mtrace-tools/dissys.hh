@@ -23,7 +23,7 @@ public:
         if (entry->h.type == mtrace_entry_access) {
             const struct mtrace_access_entry* a = &entry->access;
             if (a->traffic)
-                tid_to_distinct_set_[current_[cpu]].insert(a->guest_addr & ~63UL);
+                tid_to_distinct_set_[current_[cpu]].insert(a->guest_addr >> mtrace_summary.cline_shift);
         } else if (entry->h.type == mtrace_entry_fcall) {
             const struct mtrace_fcall_entry* f = &entry->fcall;
 
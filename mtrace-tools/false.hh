@@ -23,7 +23,7 @@ public:
         if (objs.size() > 1) {
             auto it = objs.begin();
             for (; it != objs.end(); ++it) {
-                FalseSharingInstance fsi(it->alloc_pc_, it->name_);
+                FalseSharingInstance fsi(it->alloc_pc_, *it->name_);
                 false_sharing_at_[a->pc].insert(fsi);
             }
         }
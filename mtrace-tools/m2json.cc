@@ -39,6 +39,19 @@ static void handle_entry(union mtrace_entry *entry)
                 je->put("bytes", entry->access.bytes);
                 je->put("traffic", entry->access.traffic);
                 je->put("lock", entry->access.lock);
+                if (entry->access.stack_id)
+                        je->put("stack_id", (uint64_t)entry->access.stack_id);
+                if (entry->access.cache) {
+                        je->put("cache",
+                                entry->access.cache == mtrace_cache_hit ? "hit" :
+                                entry->access.cache == mtrace_cache_miss ? "miss" :
+                                "coherence");
+                        if (entry->access.cache == mtrace_cache_coherence)
+                                je->put("cache_cpu",
+                                        (uint64_t)entry->access.cache_cpu);
+                }
+                if (entry->h.ts)
+                        je->put("ts", entry->h.ts);
 		break;
 	case mtrace_entry_host:
                 je->put("type", "host");
@@ -48,6 +61,7 @@ static void handle_entry(union mtrace_entry *entry)
                         entry->host.host_type == mtrace_call_set_cpu ? "set_cpu" :
                         entry->host.host_type == mtrace_disable_count_cpu ? "disable_count_cpu" :
                         entry->host.host_type == mtrace_enable_count_cpu ? "enable_count_cpu" :
+                        entry->host.host_type == mtrace_filter_all_cpu ? "filter_all_cpu" :
                         "unknown");
 		switch (entry->host.host_type) {
 		case mtrace_access_all_cpu:
@@ -56,6 +70,7 @@ static void handle_entry(union mtrace_entry *entry)
                                 entry->host.access.mode == mtrace_record_movement ? "movement" :
                                 entry->host.access.mode == mtrace_record_ascope ? "ascope" :
                                 entry->host.access.mode == mtrace_record_kernelscope ? "kernelscope" :
+                                entry->host.access.mode == mtrace_record_aggregate ? "aggregate" :
                                 "unknown");
                         je->put("access_str", entry->host.access.str);
 			break;
@@ -66,6 +81,31 @@ static void handle_entry(union mtrace_entry *entry)
 			else
 				je->put("call_cpu", entry->host.call.cpu);
 			break;
+		case mtrace_filter_all_cpu:
+			switch (entry->host.filter.type) {
+			case mtrace_filter_clear:
+				je->put("filter", "clear");
+				break;
+			case mtrace_filter_virt:
+			case mtrace_filter_phys:
+				je->put("filter",
+					entry->host.filter.type == mtrace_filter_virt ?
+					"virt" : "phys");
+				je->put("start", new JsonHex(entry->host.filter.start));
+				je->put("end", new JsonHex(entry->host.filter.end));
+				break;
+			case mtrace_filter_label_type:
+				je->put("filter", "type");
+				je->put("label_type", (uint64_t)entry->host.filter.label_type);
+				break;
+			case mtrace_filter_label_name:
+				je->put("filter", "label");
+				je->put("label", entry->host.filter.str);
+				break;
+			default:
+				break;
+			}
+			break;
 		default:
 			break;
 		}
@@ -94,6 +134,43 @@ static void handle_entry(union mtrace_entry *entry)
                 je->put("target_pc", new JsonHex(entry->call.target_pc));
 		je->put("return_pc", new JsonHex(entry->call.return_pc));
 		break;
+	case mtrace_entry_stack:
+                je->put("type", "stack");
+                je->put("id", (uint64_t)entry->stack.id);
+                je->put("parent", (uint64_t)entry->stack.parent);
+                je->put("target_pc", new JsonHex(entry->stack.target_pc));
+		je->put("return_pc", new JsonHex(entry->stack.return_pc));
+		break;
+	case mtrace_entry_cline:
+                je->put("type", "cline");
+                je->put("pc", new JsonHex(entry->cline.pc));
+                je->put("host_addr", new JsonHex(entry->cline.host_addr));
+                je->put("guest_addr", new JsonHex(entry->cline.guest_addr));
+                je->put("reads", entry->cline.reads);
+                je->put("writes", entry->cline.writes);
+		break;
+	case mtrace_entry_stats: {
+                JsonList* entries = JsonList::create();
+                for (int i = 0; i < MTRACE_STATS_TYPES; i++)
+                        entries->append((uint64_t)entry->stats.entries[i]);
+                je->put("type", "stats");
+                je->put("entries", entries);
+                je->put("sample_drops", entry->stats.sample_drops);
+                je->put("filter_drops", entry->stats.filter_drops);
+                je->put("get_pc", entry->stats.get_pc);
+                je->put("get_pc_slow", entry->stats.get_pc_slow);
+                je->put("rw_debug", entry->stats.rw_debug);
+                je->put("ring_stalls", entry->stats.ring_stalls);
+                je->put("ring_stall_ns", entry->stats.ring_stall_ns);
+                je->put("bytes_in", entry->stats.bytes_in);
+                je->put("bytes_out", entry->stats.bytes_out);
+                je->put("write_ns", entry->stats.write_ns);
+                je->put("cache_hits", entry->stats.cache[mtrace_cache_hit]);
+                je->put("cache_misses", entry->stats.cache[mtrace_cache_miss]);
+                je->put("cache_coherence",
+                        entry->stats.cache[mtrace_cache_coherence]);
+		break;
+	}
 	case mtrace_entry_lock:
                 je->put("type", "lock");
                 je->put("op",
@@ -126,6 +203,19 @@ static void handle_entry(union mtrace_entry *entry)
 		je->put("sample", entry->machine.sample);
 		je->put("locked", entry->machine.locked);
                 je->put("calls", entry->machine.calls);
+		je->put("line", (uint64_t)1 << entry->machine.cline_shift);
+		je->put("sample_mode",
+			entry->machine.sample_mode == mtrace_sample_count ? "count" :
+			entry->machine.sample_mode == mtrace_sample_random ? "random" :
+			entry->machine.sample_mode == mtrace_sample_line ? "line" :
+			entry->machine.sample_mode == mtrace_sample_burst ? "burst" :
+			"unknown");
+		if (entry->machine.sample_mode == mtrace_sample_burst)
+			je->put("sample_burst", entry->machine.sample_burst);
+		if (entry->machine.cache_ways) {
+			je->put("cache_size", entry->machine.cache_size);
+			je->put("cache_ways", entry->machine.cache_ways);
+		}
 		break;
 	case mtrace_entry_appdata:
                 je->put("type", "app");
@@ -26,11 +26,15 @@ static void print_entry(union mtrace_entry *entry)
 
 		[mtrace_disable_count_cpu] = "disable_count_cpu",
 		[mtrace_enable_count_cpu]  = "enable_count_cpu",
+
+		[mtrace_filter_all_cpu]    = "filter_all_cpu",
 	};
 	static const char *record_mode_to_str[] = {
 		[mtrace_record_disable]    = "disable",
 		[mtrace_record_movement]   = "movement",
 		[mtrace_record_ascope]     = "ascope",
+		[mtrace_record_kernelscope] = "kernelscope",
+		[mtrace_record_aggregate]  = "aggregate",
 	};
 	static const char *task_to_str[] = {
 		[mtrace_task_init]   = "init",
@@ -63,6 +67,16 @@ static void print_entry(union mtrace_entry *entry)
 			printf("  traffic");
 		if (entry->access.lock)
 			printf("  lock");
+		if (entry->access.stack_id)
+			printf("  stack %"PRIu32, entry->access.stack_id);
+		if (entry->access.cache == mtrace_cache_hit)
+			printf("  hit");
+		else if (entry->access.cache == mtrace_cache_miss)
+			printf("  miss");
+		else if (entry->access.cache == mtrace_cache_coherence)
+			printf("  coherence %"PRIu16, entry->access.cache_cpu);
+		if (entry->h.ts)
+			printf("  ts %"PRIu64, entry->h.ts);
 		printf("]\n");
 		break;
 	case mtrace_entry_host:
@@ -84,6 +98,29 @@ static void print_entry(union mtrace_entry *entry)
 			else
 				printf(" %"PRIu64, entry->host.call.cpu);
 			break;
+		case mtrace_filter_all_cpu:
+			switch (entry->host.filter.type) {
+			case mtrace_filter_clear:
+				printf("  clear");
+				break;
+			case mtrace_filter_virt:
+			case mtrace_filter_phys:
+				printf("  %s %016"PRIx64"-%016"PRIx64,
+				       entry->host.filter.type ==
+				       mtrace_filter_virt ? "virt" : "phys",
+				       entry->host.filter.start,
+				       entry->host.filter.end);
+				break;
+			case mtrace_filter_label_type:
+				printf("  type %u", entry->host.filter.label_type);
+				break;
+			case mtrace_filter_label_name:
+				printf("  label %s", entry->host.filter.str);
+				break;
+			default:
+				break;
+			}
+			break;
 		default:
 			break;
 		}
@@ -118,6 +155,57 @@ static void print_entry(union mtrace_entry *entry)
 		       entry->call.target_pc,
 		       entry->call.return_pc);
 		break;
+	case mtrace_entry_stack:
+		printf("%-3s [%-3u  %6"PRIu32"  parent %6"PRIu32"  %16"PRIx64" %16"PRIx64"]\n",
+		       "stk",
+		       entry->h.cpu,
+		       entry->stack.id,
+		       entry->stack.parent,
+		       entry->stack.target_pc,
+		       entry->stack.return_pc);
+		break;
+	case mtrace_entry_cline:
+		printf("%-3s [%-3u  pc %016"PRIx64"  host %016"PRIx64"  guest %016"PRIx64"  rd %"PRIu64"  wr %"PRIu64"]\n",
+		       "agg",
+		       entry->h.cpu,
+		       entry->cline.pc,
+		       entry->cline.host_addr,
+		       entry->cline.guest_addr,
+		       entry->cline.reads,
+		       entry->cline.writes);
+		break;
+	case mtrace_entry_stats: {
+		uint64_t n = 0;
+		int i;
+
+		for (i = 0; i < MTRACE_STATS_TYPES; i++)
+			n += entry->stats.entries[i];
+		printf("%-3s [%-3u  entries %"PRIu64" (%"PRIu64" accesses)  drops %"PRIu64"  filter drops %"PRIu64"  get_pc %"PRIu64" (%"PRIu64" slow)  rw_debug %"PRIu64"  stalls %"PRIu64" (%"PRIu64" ns)  in %"PRIu64"  out %"PRIu64"  write %"PRIu64" ns]\n",
+		       "sts",
+		       entry->h.cpu,
+		       n,
+		       entry->stats.entries[mtrace_entry_access],
+		       entry->stats.sample_drops,
+		       entry->stats.filter_drops,
+		       entry->stats.get_pc,
+		       entry->stats.get_pc_slow,
+		       entry->stats.rw_debug,
+		       entry->stats.ring_stalls,
+		       entry->stats.ring_stall_ns,
+		       entry->stats.bytes_in,
+		       entry->stats.bytes_out,
+		       entry->stats.write_ns);
+		if (entry->stats.cache[mtrace_cache_hit] ||
+		    entry->stats.cache[mtrace_cache_miss] ||
+		    entry->stats.cache[mtrace_cache_coherence])
+			printf("%-3s [%-3u  cache hits %"PRIu64"  misses %"PRIu64"  coherence %"PRIu64"]\n",
+			       "sts",
+			       entry->h.cpu,
+			       entry->stats.cache[mtrace_cache_hit],
+			       entry->stats.cache[mtrace_cache_miss],
+			       entry->stats.cache[mtrace_cache_coherence]);
+		break;
+	}
 	case mtrace_entry_lock:
 		printf("%-3s [%-3u  ts %16"PRIu64" pc %16"PRIx64"  lock %16"PRIx64"  %s]\n",
 		       entry->lock.op == mtrace_lockop_release ? "r" 
@@ -145,14 +233,28 @@ static void print_entry(union mtrace_entry *entry)
 		break;
 	case mtrace_entry_machine:
 		printf("%-3s [cpus %"PRIu16"  ram %"PRIu64"  quantum %"PRIu64
-		       "  sample %"PRIu64"  locked %c  calls %c]\n",
+		       "  sample %"PRIu64"  locked %c  calls %c  format %u"
+		       "  line %u",
 		       "mac",
 		       entry->machine.num_cpus,
 		       entry->machine.num_ram,
 		       entry->machine.quantum,
 		       entry->machine.sample,
 		       entry->machine.locked ? 't' : 'f',
-		       entry->machine.calls ? 't' : 'f');
+		       entry->machine.calls ? 't' : 'f',
+		       entry->machine.format,
+		       1U << entry->machine.cline_shift);
+		if (entry->machine.cache_ways)
+			printf("  cache %"PRIu64"/%u",
+			       entry->machine.cache_size,
+			       entry->machine.cache_ways);
+		if (entry->machine.sample_mode == mtrace_sample_random)
+			printf("  random");
+		else if (entry->machine.sample_mode == mtrace_sample_line)
+			printf("  by line");
+		else if (entry->machine.sample_mode == mtrace_sample_burst)
+			printf("  burst %"PRIu64, entry->machine.sample_burst);
+		printf("]\n");
 		break;
 	case mtrace_entry_appdata:
 		printf("%-3s [%-3u  type %"PRIu16"  u64 %"PRIu64"]\n",
@@ -47,6 +47,7 @@ MtraceSummary mtrace_summary;
 pc_t mtrace_call_pc[MAX_CPUS];
 tid_t mtrace_tid[MAX_CPUS];
 MtraceAddr2label mtrace_label_map;
+MtraceStrings mtrace_strings;
 uint64_t mtrace_object_count;
 CallTrace* mtrace_call_trace;
 dwarf::dwarf mtrace_dwarf;
@@ -78,6 +79,26 @@ static struct MtraceOptions {
     MtraceOptions() : elf_file("mscan.kern"), log_file("mtrace.out") {}
 } mtrace_options;
 
+// Here rather than in mscan.hh since read_entry_str_id is per file
+const string*
+MtraceStrings::entry_name(const char* str)
+{
+    // Names from older logs, or made up by mscan, have no id
+    if (read_entry_str_id == 0)
+        return intern(str);
+
+    // Each segment numbers its names from 1 again
+    if (segment_ != read_entry_segment) {
+        by_id_.clear();
+        segment_ = read_entry_segment;
+    }
+    if (read_entry_str_id >= by_id_.size())
+        by_id_.resize(read_entry_str_id + 1);
+    if (by_id_[read_entry_str_id] == nullptr)
+        by_id_[read_entry_str_id] = intern(str);
+    return by_id_[read_entry_str_id];
+}
+
 class DefaultHostHandler : public EntryHandler {
 public:
     virtual void handle(const union mtrace_entry* entry) {
@@ -85,7 +106,8 @@ public:
         if (e->host_type == mtrace_call_clear_cpu ||
             e->host_type == mtrace_call_set_cpu ||
             e->host_type == mtrace_disable_count_cpu ||
-            e->host_type == mtrace_enable_count_cpu) {
+            e->host_type == mtrace_enable_count_cpu ||
+            e->host_type == mtrace_filter_all_cpu) {
             return;
         } else if (e->host_type != mtrace_access_all_cpu)
             die("handle_host: unhandled type %u", e->host_type);
@@ -113,6 +135,7 @@ class DefaultMachineHandler : public EntryHandler {
         const struct mtrace_machine_entry* m = &entry->machine;
         mtrace_summary.num_cpus = m->num_cpus;
         mtrace_summary.num_ram = m->num_ram;
+        mtrace_summary.cline_shift = m->cline_shift;
     }
 };
 
@@ -255,6 +278,8 @@ static void init_handlers(void)
     mtrace_call_trace = call_trace;
     entry_handler[mtrace_entry_call].push_back(call_trace);
     entry_handler[mtrace_entry_fcall].push_back(call_trace);
+    entry_handler[mtrace_entry_stack].push_back(call_trace);
+    entry_handler[mtrace_entry_access].push_back(call_trace);
 
     //
     // Extra handlers come next
@@ -311,6 +336,7 @@ static void init_handlers(void)
     if (mtrace_options.shared_addresses) {
         SharedAddresses* addrs = new SharedAddresses();
         entry_handler[mtrace_entry_access].push_back(addrs);
+        entry_handler[mtrace_entry_cline].push_back(addrs);
         exit_handler.push_back(addrs);
     }
 
@@ -326,6 +352,7 @@ static void init_handlers(void)
         AllSharing* as = new AllSharing();
         entry_handler[mtrace_entry_host].push_back(as);
         entry_handler[mtrace_entry_access].push_back(as);
+        entry_handler[mtrace_entry_cline].push_back(as);
         exit_handler.push_back(as);
     }
 
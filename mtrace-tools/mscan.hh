@@ -5,6 +5,8 @@
 #include <sstream>
 #include <iomanip>
 #include <list>
+#include <unordered_set>
+#include <vector>
 
 #include "addr2line.hh"
 #include "bininfo.hh"
@@ -35,8 +37,38 @@ struct MtraceSummary {
     char app_name[32];
     uint16_t num_cpus;
     uint64_t num_ram;
+    uint8_t cline_shift;
 };
 
+// A summary of the application/workload
+extern MtraceSummary mtrace_summary;
+
+//
+// One shared copy of each name in the log.  Entries from
+// MTRACE_FORMAT_V3 logs carry ids, so each id is resolved only once
+// per segment.
+//
+class MtraceStrings {
+public:
+    MtraceStrings() : segment_(0) {}
+
+    // The interned copy of str, the name in the entry read_entry
+    // last returned
+    const string* entry_name(const char* str);
+
+private:
+    const string* intern(const char* str) {
+        // Names are char[64], and may fill it
+        return &*by_str_.insert(string(str, strnlen(str, 64))).first;
+    }
+
+    unordered_set<string> by_str_;
+    vector<const string*> by_id_;
+    uint32_t segment_;
+};
+
+extern MtraceStrings mtrace_strings;
+
 struct MtraceObject {
     MtraceObject(void) {}
 
@@ -45,11 +77,11 @@ struct MtraceObject {
         guest_addr_ = l->guest_addr;
         bytes_= l->bytes;
         guest_addr_end_ = guest_addr_ + bytes_;
-        name_ = l->str;
+        name_ = mtrace_strings.entry_name(l->str);
         alloc_pc_ = l->pc;
     }
 
-    string name_;
+    const string* name_;
     object_id_t id_;
     guest_addr_t guest_addr_;
     guest_addr_t guest_addr_end_;
@@ -69,7 +101,7 @@ public:
 
         if (object_first_.find(l->guest_addr) != object_first_.end()) {
 	    fprintf(stderr, "add_label: overlapping labels: l1 %s l2 %s\n",
-                    l->str, object_first_.find(l->guest_addr)->second->name_.c_str());
+                    l->str, object_first_.find(l->guest_addr)->second->name_->c_str());
             return;
 	}
 
@@ -148,8 +180,9 @@ public:
         guest_addr_t caddr;
         guest_addr_t next_caddr;
 
-        caddr = addr & ~63;
-        next_caddr = caddr + 64;
+        caddr = addr >> mtrace_summary.cline_shift;
+        caddr <<= mtrace_summary.cline_shift;
+        next_caddr = caddr + (1UL << mtrace_summary.cline_shift);
 
         auto it = object_last_.lower_bound(caddr);
         for (; it != object_last_.end(); ++it) {
@@ -217,8 +250,6 @@ extern struct mtrace_host_entry mtrace_first;
 extern struct mtrace_host_entry mtrace_enable;
 // An addr2line instance for the ELF file
 extern Addr2line* addr2line;
-// A summary of the application/workload
-extern MtraceSummary mtrace_summary;
 // The current fcall/kernel entry point
 extern pc_t mtrace_call_pc[MAX_CPUS];
 // The current task ID
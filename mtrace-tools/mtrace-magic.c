@@ -7,10 +7,12 @@ int main(int ac, char **av)
         mtrace_enable_set(mtrace_record_movement, av[2]);
     else if (ac == 3 && strcmp(av[1], "ascope") == 0)
         mtrace_enable_set(mtrace_record_ascope, av[2]);
+    else if (ac == 3 && strcmp(av[1], "aggregate") == 0)
+        mtrace_enable_set(mtrace_record_aggregate, av[2]);
     else if (ac == 3 && strcmp(av[1], "disable") == 0)
         mtrace_enable_set(mtrace_record_disable, av[2]);
     else {
-        fprintf(stderr, "usage: %s movement|ascope|disable name", basename(av[0]));
+        fprintf(stderr, "usage: %s movement|ascope|aggregate|disable name", basename(av[0]));
         return 2;
     }
     return 0;
@@ -1,7 +1,7 @@
 #pragma once
 
 struct PhysicalAccess {
-    string type;
+    const string *type = nullptr;   // Interned by mtrace_strings
     uint64_t base;
     uint64_t access;
     uint64_t pc;
@@ -13,12 +13,12 @@ struct PhysicalAccess {
     JsonDict *to_json(const PhysicalAccess *other = nullptr) const
     {
         JsonDict *out = JsonDict::create();
-        if (type.size()) {
+        if (type && type->size()) {
             // XXX For static symbols, we only have the name of
             // the symbol, not the name of its type.
-            out->put("addr", resolve_type_offset(mtrace_dwarf, type, base, access - base, pc));
-            if (other && other->type.size() && other->type != type)
-              out->put("addr2", resolve_type_offset(mtrace_dwarf, type, base, access - base, pc));
+            out->put("addr", resolve_type_offset(mtrace_dwarf, *type, base, access - base, pc));
+            if (other && other->type && other->type->size() && other->type != type)
+              out->put("addr2", resolve_type_offset(mtrace_dwarf, *type, base, access - base, pc));
         } else {
             out->put("addr", new JsonHex(access));
         }
@@ -69,7 +69,8 @@ struct PhysicalAccess {
 
     bool mergable(const PhysicalAccess &o) const
     {
-        // Note that we don't require equivalent call stacks.
+        // Note that we don't require equivalent call stacks.  Types
+        // are interned, so comparing pointers compares names.
         return (access <= o.access + o.size) && (o.access <= access + size) &&
             type == o.type && base == o.base && pc == o.pc &&
             is_write == o.is_write;
@@ -1,4 +1,5 @@
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -32,13 +33,227 @@ static void __noret__ __chfmt__ edie(const char* errstr, ...)
         exit(EXIT_FAILURE);
 }
 
+/*
+ * Previous access state for expanding MTRACE_FORMAT_V2 compact access
+ * records (see mtrace-magic.h)
+ */
+struct compact_cpu {
+	uint64_t pc;
+	uint64_t host_addr;
+	uint64_t guest_addr;
+	uint32_t stack_id;
+	uint64_t ts;
+};
+
+static struct {
+	struct compact_cpu *cpus;
+	unsigned int ncpus;
+	uint16_t cpu;
+	uint64_t count;
+	uint8_t format;		/* From the last machine entry */
+	uint8_t cache;		/* ... and whether it has a cache model */
+} compact;
+
+static struct compact_cpu *compact_cpu_get(uint16_t cpu)
+{
+	if (cpu >= compact.ncpus) {
+		unsigned int n = cpu + 1;
+
+		compact.cpus = (struct compact_cpu *)
+			realloc(compact.cpus, n * sizeof(compact.cpus[0]));
+		if (compact.cpus == NULL)
+			die("realloc failed");
+		memset(&compact.cpus[compact.ncpus], 0,
+		       (n - compact.ncpus) * sizeof(compact.cpus[0]));
+		compact.ncpus = n;
+	}
+	return &compact.cpus[cpu];
+}
+
+static void compact_update(struct mtrace_access_entry *a)
+{
+	struct compact_cpu *c = compact_cpu_get(a->h.cpu);
+
+	c->pc = a->pc;
+	c->host_addr = a->host_addr;
+	c->guest_addr = a->guest_addr;
+	c->stack_id = a->stack_id;
+	c->ts = a->h.ts;
+	compact.cpu = a->h.cpu;
+	compact.count = a->h.access_count + 1;
+}
+
+static int read_varint(gzFile fp, uint64_t *v)
+{
+	int c, shift = 0;
+
+	*v = 0;
+	do {
+		c = gzgetc(fp);
+		if (c < 0 || shift > 63)
+			return -1;
+		*v |= (uint64_t)(c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+	return 0;
+}
+
+static int read_zigzag(gzFile fp, uint64_t prev, uint64_t *v)
+{
+	uint64_t z;
+
+	if (read_varint(fp, &z))
+		return -1;
+	*v = prev + ((z >> 1) ^ -(z & 1));
+	return 0;
+}
+
+static int read_compact_access(gzFile fp, int tag,
+			       struct mtrace_access_entry *a)
+{
+	struct compact_cpu *c;
+	uint64_t cpu = compact.cpu;
+	uint64_t count = compact.count;
+	uint64_t pc, host_addr, guest_addr, ts = 0, cache = 0;
+	int bytes;
+
+	if ((tag & MTRACE_COMPACT_CPU) && read_varint(fp, &cpu))
+		return -1;
+	if (cpu > 0xffff)
+		die("compact access cpu too big");
+	if ((tag & MTRACE_COMPACT_COUNT) && read_zigzag(fp, count, &count))
+		return -1;
+
+	c = compact_cpu_get(cpu);
+	if (read_zigzag(fp, c->pc, &pc) ||
+	    read_zigzag(fp, c->host_addr, &host_addr) ||
+	    read_zigzag(fp, c->guest_addr, &guest_addr))
+		return -1;
+	if (compact.format >= MTRACE_FORMAT_V5 && read_zigzag(fp, c->ts, &ts))
+		return -1;
+	bytes = gzgetc(fp);
+	if (bytes < 0)
+		return -1;
+	if (compact.format >= MTRACE_FORMAT_V6 && compact.cache &&
+	    read_varint(fp, &cache))
+		return -1;
+	if ((cache >> 2) > 0xffff)
+		die("compact access cache cpu too big");
+
+	memset(a, 0, sizeof(*a));
+	a->h.type = mtrace_entry_access;
+	a->h.size = sizeof(*a);
+	a->h.cpu = cpu;
+	a->h.access_count = count;
+	a->h.ts = ts;
+	a->access_type = (mtrace_access_t)(tag & MTRACE_COMPACT_TYPE);
+	a->pc = pc;
+	a->host_addr = host_addr;
+	a->guest_addr = guest_addr;
+	a->traffic = !!(tag & MTRACE_COMPACT_TRAFFIC);
+	a->lock = !!(tag & MTRACE_COMPACT_LOCK);
+	a->deps = !!(tag & MTRACE_COMPACT_DEPS);
+	a->bytes = bytes;
+	a->stack_id = c->stack_id;
+	a->cache = cache & 3;
+	a->cache_cpu = cache >> 2;
+	compact_update(a);
+	return 1;
+}
+
+/*
+ * Interned names (MTRACE_FORMAT_V3), indexed by id.  read_entry_str_id
+ * is the id of the name in the entry read_entry last returned, or 0 if
+ * that entry's name wasn't interned.  Ids restart in each segment, so
+ * read_entry_segment counts the machine entries read so far; an id
+ * means the same name only while that stays the same.
+ */
+static struct {
+	char (*strs)[64];
+	uint32_t nstrs;
+} interned;
+
+static uint32_t read_entry_str_id;
+static uint32_t read_entry_segment;
+
+static void interned_add(const struct mtrace_string_entry *s)
+{
+	size_t len = s->h.size - offsetof(struct mtrace_string_entry, str);
+
+	if (s->id == 0 || len > sizeof(s->str))
+		die("bad string entry");
+	if (s->id >= interned.nstrs) {
+		uint32_t n = interned.nstrs ? interned.nstrs : 1024;
+
+		while (n <= s->id)
+			n *= 2;
+		interned.strs = (char (*)[64])
+			realloc(interned.strs, n * sizeof(interned.strs[0]));
+		if (interned.strs == NULL)
+			die("realloc failed");
+		memset(&interned.strs[interned.nstrs], 0,
+		       (n - interned.nstrs) * sizeof(interned.strs[0]));
+		interned.nstrs = n;
+	}
+	memset(interned.strs[s->id], 0, sizeof(interned.strs[0]));
+	memcpy(interned.strs[s->id], s->str, len);
+}
+
+/* Read the rest of an entry whose name was replaced by its id */
+static int read_interned(gzFile fp, union mtrace_entry *entry_out)
+{
+	unsigned int off = mtrace_entry_name_offset(entry_out->h.type);
+	char *p = (char *)entry_out;
+	size_t left;
+	uint32_t id;
+
+	if (off == 0 || entry_out->h.size < off + sizeof(id) ||
+	    entry_out->h.size - sizeof(id) + sizeof(interned.strs[0]) >
+	    sizeof(*entry_out))
+		die("bad interned entry type %u size %u",
+		    (unsigned)entry_out->h.type, (unsigned)entry_out->h.size);
+
+	left = off - sizeof(entry_out->h);
+	if (gzread(fp, p + sizeof(entry_out->h), left) != (int)left ||
+	    gzread(fp, &id, sizeof(id)) != sizeof(id))
+		return -1;
+	left = entry_out->h.size - off - sizeof(id);
+	if (gzread(fp, p + off + sizeof(interned.strs[0]), left) != (int)left)
+		return -1;
+
+	if (id == 0 || id >= interned.nstrs)
+		die("unknown string id %u", id);
+	memcpy(p + off, interned.strs[id], sizeof(interned.strs[0]));
+	entry_out->h.size += sizeof(interned.strs[0]) - sizeof(id);
+	read_entry_str_id = id;
+	return 1;
+}
+
+/*
+ * Read the next entry, expanding compact access records and interned
+ * names, so callers always see a full union mtrace_entry.
+ */
 __attribute__((__used__))
 static int read_entry(gzFile fp, union mtrace_entry *entry_out)
 {
 	size_t r, left;
-	r = gzread(fp, entry_out, sizeof(entry_out->h));
-	if (r != sizeof(entry_out->h))
-		return r == 0 ? 0 : -1;
+	int c;
+
+again:
+	read_entry_str_id = 0;
+	c = gzgetc(fp);
+	if (c < 0)
+		return gzeof(fp) ? 0 : -1;
+	if (c & MTRACE_COMPACT_TAG)
+		return read_compact_access(fp, c, &entry_out->access);
+
+	*(uint8_t *)entry_out = c & ~MTRACE_ENTRY_INTERNED;
+	left = sizeof(entry_out->h) - 1;
+	r = gzread(fp, ((char*)entry_out) + 1, left);
+	if (r != left)
+		return -1;
+	if (c & MTRACE_ENTRY_INTERNED)
+		return read_interned(fp, entry_out);
 	if (entry_out->h.size > sizeof(*entry_out))
 		die("entry too big: %u > %u",
 		    (unsigned)entry_out->h.size, (unsigned)sizeof(*entry_out));
@@ -46,5 +261,48 @@ static int read_entry(gzFile fp, union mtrace_entry *entry_out)
 	r = gzread(fp, ((char*)entry_out) + sizeof(entry_out->h), left);
 	if (r != left)
 		return -1;
+
+	if (entry_out->h.type == mtrace_entry_access) {
+		/* Logs before MTRACE_FORMAT_V4 have no stack_id, and
+		 * older ones no cache result */
+		if (entry_out->h.size < sizeof(entry_out->access))
+			memset(((char*)entry_out) + entry_out->h.size, 0,
+			       sizeof(entry_out->access) - entry_out->h.size);
+		compact_update(&entry_out->access);
+	} else if (entry_out->h.type == mtrace_entry_stats) {
+		/* Older logs have no filter or cache counters */
+		if (entry_out->h.size < sizeof(entry_out->stats))
+			memset(((char*)entry_out) + entry_out->h.size, 0,
+			       sizeof(entry_out->stats) - entry_out->h.size);
+	} else if (entry_out->h.type == mtrace_entry_string) {
+		interned_add(&entry_out->name);
+		goto again;
+	} else if (entry_out->h.type == mtrace_entry_machine) {
+		/* Each segment of the log starts from scratch */
+		if (compact.ncpus)
+			memset(compact.cpus, 0,
+			       compact.ncpus * sizeof(compact.cpus[0]));
+		compact.cpu = 0;
+		compact.count = 0;
+		read_entry_segment++;
+		if (entry_out->h.size < offsetof(struct mtrace_machine_entry,
+						 format) + 1)
+			entry_out->machine.format = MTRACE_FORMAT_V1;
+		/* Logs without a granularity tracked 64-byte lines */
+		if (entry_out->h.size < offsetof(struct mtrace_machine_entry,
+						 cline_shift) + 1)
+			entry_out->machine.cline_shift = 6;
+		if (entry_out->h.size < offsetof(struct mtrace_machine_entry,
+						 sample_mode)) {
+			entry_out->machine.cache_size = 0;
+			entry_out->machine.cache_ways = 0;
+		}
+		if (entry_out->h.size < sizeof(entry_out->machine)) {
+			entry_out->machine.sample_mode = mtrace_sample_count;
+			entry_out->machine.sample_burst = 0;
+		}
+		compact.format = entry_out->machine.format;
+		compact.cache = entry_out->machine.cache_ways != 0;
+	}
 	return 1;
 }
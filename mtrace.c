@@ -28,36 +28,77 @@
 #include "mtrace-magic.h"
 #include "mtrace.h"
 #include "sysemu.h"
+#include "monitor.h"
+#include "qjson.h"
+#include "qlist.h"
+#include "qerror.h"
+#include "qemu-barrier.h"
 
-#include <sys/wait.h>
-
-/* 64-byte cache lines */
-#define MTRACE_CLINE_SHIFT	6
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <zlib.h>
 
 /* From dyngen-exec.h */
 #define MTRACE_GETPC() ((void *)((unsigned long)__builtin_return_address(0) - 1))
 
-/* Bytes of log data to buffer before shipping it to gzip */
+/* Bytes of log data to buffer before writing it to a FIFO */
 #define FLUSH_BUFFER_BYTES 8192
 
+/* Bytes of log data per independently compressed gzip member */
+#define MTRACE_CHUNK_BYTES (1 << 20)
+#define MTRACE_COMPRESS_MAX_THREADS 4
+
+/* Default bytes of log ring per CPU */
+#define MTRACE_RING_BYTES (1 << 20)
+
+/* Default bytes of log (before compression) per segment */
+#define MTRACE_SEGMENT_BYTES (64 << 20)
+
 static int mtrace_system_enable;
 static mtrace_record_mode_t mtrace_mode;
+static mtrace_instrument_t mtrace_instrument;
 static int mtrace_lock_trace;
 
 static int mtrace_file;
+static char *mtrace_file_path;
+static int mtrace_file_fifo;
+static FILE *mtrace_index;
+static uint64_t mtrace_segment_size = MTRACE_SEGMENT_BYTES;
+static int mtrace_compress_level = Z_DEFAULT_COMPRESSION;
+static int mtrace_format = MTRACE_FORMAT_V6;
 static int mtrace_cline_track = 1;
+static mtrace_cline_encoding_t mtrace_cline_encoding;
+static int mtrace_cline_sharer_bytes;
+static uint32_t mtrace_cline_epoch = 1;
+static uint64_t mtrace_cache_size;	/* See mtrace_cache_access */
+static int mtrace_cache_ways;
+static uint64_t mtrace_cache_sets;
 static int mtrace_sample = 1;
+static mtrace_sample_t mtrace_sample_mode;
+static uint64_t mtrace_sample_insns;	/* Burst length */
+static int mtrace_stats_interval;
+static QEMUTimer *mtrace_stats_timer;
 static int mtrace_quantum;
 
-static uint64_t mtrace_access_count;
+uint64_t mtrace_access_count;
 static int mtrace_call_stack_active[255];
 static int mtrace_call_trace;
 static volatile int mtrace_lock_active[255];
 
-static pid_t child_pid;
-
-static uint64_t mtrace_inst_count[255];
+/*
+ * Instructions are counted per TB in env->mtrace_insn_count.  While a
+ * CPU has counting disabled, we remember where it stopped and later
+ * subtract the instructions it ran in the meantime.
+ */
 static int mtrace_count_disable[255];
+static uint64_t mtrace_count_disable_start[255];
+static uint64_t mtrace_count_skip[255];
+
+/* CPUs with a registered mtrace_guest_ring */
+static int mtrace_guest_nrings;
+static void mtrace_guest_ring_drain(int cpu, uint64_t access_count);
+static void mtrace_guest_ring_drain_all(uint64_t access_count);
 
 /* Call stack tag by CPU */
 static uint64_t mtrace_call_stack[255];
@@ -67,249 +108,1946 @@ struct mtrace_call_stack_info
 {
     uint64_t tag;
     int ascope_depth;
-} mtrace_per_call_stack[0x8000];
+    uint32_t stack_id;		/* Shadow call stack (MTRACE_FORMAT_V4) */
+    /* Accesses logged since the last ascope enter or exit */
+    uint64_t *seen;
+    uint32_t seen_size;
+    uint32_t seen_count;
+};
+
+/*
+ * Call stacks by tag, open-addressed with linear probing.  A tag of 0
+ * marks a free slot.  The table doubles when it's half full, so lookups
+ * stay short however many kernel stacks are live.
+ */
+static struct mtrace_call_stack_info *mtrace_per_call_stack;
+static unsigned int mtrace_per_call_stack_bits;
+
+static struct {
+    uint64_t live;		/* Tags in the table */
+    uint64_t peak;		/* Most tags ever in the table */
+    uint64_t lookups;
+    uint64_t probes;		/* Slots examined by lookups */
+    uint64_t grows;
+} mtrace_call_stack_stats;
+
+void mtrace_cline_trace_set(int b)
+{
+    mtrace_cline_track = b;
+}
+
+void mtrace_lock_trace_set(int b)
+{
+    mtrace_lock_trace = b;
+}
+
+void mtrace_system_enable_set(int b)
+{
+    mtrace_system_enable = b;
+}
+
+int mtrace_system_enable_get(void)
+{
+    return mtrace_system_enable;
+}
+
+void mtrace_call_trace_set(int b)
+{
+    mtrace_call_trace = b;
+}
+
+/* Parse -mtrace-sample N[,random|line|burst=instructions] */
+int mtrace_sample_parse(const char *spec)
+{
+    mtrace_sample_t mode = mtrace_sample_count;
+    uint64_t burst = 0;
+    char *end;
+    long n;
+
+    n = strtol(spec, &end, 10);
+    if (n < 1 || n > INT_MAX)
+	return -1;
+    if (*end == ',') {
+	spec = end + 1;
+	end = (char *)spec + strlen(spec);
+	if (!strcmp(spec, "random")) {
+	    mode = mtrace_sample_random;
+	} else if (!strcmp(spec, "line")) {
+	    mode = mtrace_sample_line;
+	} else if (!strncmp(spec, "burst=", 6)) {
+	    mode = mtrace_sample_burst;
+	    burst = strtoull(spec + 6, &end, 10);
+	    if (burst == 0)
+		return -1;
+	} else {
+	    return -1;
+	}
+    }
+    if (*end)
+	return -1;
+    mtrace_sample = n;
+    mtrace_sample_mode = mode;
+    mtrace_sample_insns = burst;
+    return 0;
+}
+
+int mtrace_enable_get(void)
+{
+    return mtrace_mode != 0;
+}
+
+int mtrace_instrument_get(void)
+{
+    return mtrace_instrument;
+}
+
+/*
+ * In movement mode, the i386 TCG backend checks cline_track inline
+ * and only calls mtrace_tcg_ld/st if the line moves (see
+ * tcg_out_mtrace).  For each TLB entry, env->mtrace_cline_tlb holds
+ * the address of the page's cline_track bytes minus the page's host
+ * address >> mtrace_cline_shift.  env->mtrace_cline_mask holds the
+ * CPU's bit (or cpu_index with the owner encoding), or
+ * MTRACE_CLINE_MASK_NONE if every access has to go out of line (e.g.
+ * while a locked instruction is being traced).
+ */
+#define MTRACE_CLINE_MASK_NONE	0x100
+
+/*
+ * Lines are tracked at this granularity.  It's fixed before anything
+ * is translated, since the inline check bakes it into the code.
+ */
+int mtrace_cline_shift = 6;
+
+#define MTRACE_CLINES_PER_PAGE	(TARGET_PAGE_SIZE >> mtrace_cline_shift)
+
+/*
+ * Pages without tracking never match (enough for 8-byte lines).  No
+ * CPU's bit is 0, but CPU 0's owner id is, so mtrace_reset_cline_track
+ * fills this with MTRACE_CLINE_UNTRACKED for the owner encoding.
+ */
+static uint8_t mtrace_cline_none[TARGET_PAGE_SIZE >> 3];
+
+/*
+ * Reset the page's lines to shared by every CPU if they were tracked
+ * before the last mtrace_reset_cline_track.  Both the out-of-line
+ * update and the mtrace_cline_tlb entries the inline check goes
+ * through come here first.
+ */
+static void mtrace_cline_page_refresh(RAMBlock *block, ram_addr_t offset)
+{
+    ram_addr_t page = offset >> TARGET_PAGE_BITS;
+
+    if (block->cline_epoch[page] == mtrace_cline_epoch)
+	return;
+    block->cline_epoch[page] = mtrace_cline_epoch;
+    memset(block->cline_track + page * MTRACE_CLINES_PER_PAGE, 0xff,
+	   MTRACE_CLINES_PER_PAGE);
+    if (block->cline_sharers && block->cline_sharers[page]) {
+	qemu_free(block->cline_sharers[page]);
+	block->cline_sharers[page] = NULL;
+    }
+}
+
+unsigned long mtrace_cline_tlb_addend(void *host_page)
+{
+    uint8_t *host = host_page;
+    uint8_t *track = mtrace_cline_none;
+    RAMBlock *block;
+
+    /* Unlike qemu_ramblock_from_host, tolerate stale TLB entries */
+    block = ramblock_find_host(host);
+    if (block && block->cline_track) {
+	mtrace_cline_page_refresh(block, host - block->host);
+	track = block->cline_track +
+	    ((host - block->host) >> mtrace_cline_shift);
+    }
+    return (unsigned long)track - ((unsigned long)host >> mtrace_cline_shift);
+}
+
+/*
+ * Recompute env->mtrace_cline_tlb for the TLB's current contents.
+ * (Flushing the TLB instead would show up as extra code accesses.)
+ */
+static void mtrace_cline_tlb_refill(CPUX86State *env)
+{
+    CPUTLBEntry *te;
+    target_ulong addr;
+    int mmu_idx, i;
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+	for (i = 0; i < CPU_TLB_SIZE; i++) {
+	    te = &env->tlb_table[mmu_idx][i];
+	    /* Only entries the TCG fast path can hit matter */
+	    if (!(te->addr_read & ~TARGET_PAGE_MASK))
+		addr = te->addr_read;
+	    else if (!(te->addr_write & ~TARGET_PAGE_MASK))
+		addr = te->addr_write;
+	    else
+		continue;
+	    env->mtrace_cline_tlb[mmu_idx][i] =
+		mtrace_cline_tlb_addend((void *)(addr + te->addend));
+	}
+    }
+}
+
+static void mtrace_cline_mask_update(CPUX86State *env)
+{
+    if (mtrace_lock_active[env->cpu_index])
+	env->mtrace_cline_mask = MTRACE_CLINE_MASK_NONE;
+    else if (mtrace_cline_encoding == mtrace_cline_owner)
+	env->mtrace_cline_mask = env->cpu_index;
+    else
+	env->mtrace_cline_mask = 1 << env->cpu_index;
+}
+
+/*
+ * Translated code only carries calls into mtrace while the guest has
+ * recording enabled.  Switching between the instrumented and the
+ * "fast-forward" variants requires retranslating everything.  The
+ * magic instruction always ends its TB, so it's safe to flush here.
+ */
+static void mtrace_instrument_set(mtrace_instrument_t b)
+{
+    CPUX86State *env;
+
+    if (mtrace_instrument == b)
+	return;
+    mtrace_instrument = b;
+    tb_flush(cpu_single_env);
+    tb_invalidated_flag = 1;
+
+    /* tlb_set_page only fills in mtrace_cline_tlb while filtering */
+    if (b == mtrace_instrument_filter) {
+	for (env = first_cpu; env != NULL; env = env->next_cpu) {
+	    mtrace_cline_mask_update(env);
+	    mtrace_cline_tlb_refill(env);
+	}
+    }
+}
+
+static mtrace_instrument_t mtrace_instrument_mode(mtrace_record_mode_t mode)
+{
+    if (mode == mtrace_record_disable)
+	return mtrace_instrument_none;
+    /* The cache model has to see every access */
+    if (mode == mtrace_record_movement && mtrace_cline_track &&
+	!mtrace_cache_ways)
+	return mtrace_instrument_filter;
+    return mtrace_instrument_call;
+}
+
+void mtrace_stats_interval_set(int seconds)
+{
+    mtrace_stats_interval = seconds;
+}
+
+void mtrace_quantum_set(int n)
+{
+    mtrace_quantum = n;
+}
+
+int mtrace_quantum_get(void)
+{
+    return mtrace_quantum;
+}
+
+/* Returns the new log's fd, or -1 with errno set */
+static int mtrace_log_open(const char *path, int *fifo)
+{
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_CREAT|O_WRONLY|O_TRUNC, 0666);
+    if (fd < 0)
+	return -1;
+    if (fstat(fd, &st) < 0) {
+	close(fd);
+	return -1;
+    }
+    /* Whoever reads a FIFO probably wants the entries as they happen */
+    *fifo = S_ISFIFO(st.st_mode);
+    return fd;
+}
+
+void mtrace_log_file_set(const char *path)
+{
+    mtrace_file = mtrace_log_open(path, &mtrace_file_fifo);
+    if (mtrace_file < 0) {
+        perror("mtrace: open");
+        abort();
+    }
+    qemu_free(mtrace_file_path);
+    mtrace_file_path = qemu_strdup(path);
+}
+
+void mtrace_segment_set(uint64_t bytes)
+{
+    mtrace_segment_size = bytes;
+}
+
+/*
+ * An optional private cache per CPU, kept coherent with MESI.  In
+ * movement mode it stands in for cline_track: every access goes
+ * through mtrace_cache_access, and only misses are logged.  Lines are
+ * mtrace_cline_shift bytes and sets are picked by the low bits of the
+ * host line address.  An invalidated way keeps its line as "stolen", so
+ * the next access to it is a coherence miss rather than a capacity
+ * miss, until the way is reused.
+ */
+typedef enum {
+    mtrace_mesi_invalid = 0,
+    mtrace_mesi_shared,
+    mtrace_mesi_exclusive,
+    mtrace_mesi_modified,
+} mtrace_mesi_t;
+
+struct mtrace_cache_way {
+    uint64_t line;		/* host_addr >> mtrace_cline_shift */
+    uint64_t used;		/* mtrace_cache_clock of the last access */
+    uint8_t state;		/* mtrace_mesi_t */
+    uint8_t stolen;		/* Invalidated by a store on thief */
+    uint16_t thief;
+};
+
+static struct mtrace_cache_way *mtrace_cache[255];
+static uint64_t mtrace_cache_clock;
+
+/* The result of each CPU's last access, for mtrace_access_dump */
+static struct {
+    mtrace_cache_t result;
+    uint16_t cpu;
+} mtrace_cache_last[255];
+
+int mtrace_cache_set(uint64_t bytes, int ways)
+{
+    if (ways < 1 || ways > 255 || bytes == 0)
+	return -1;
+    mtrace_cache_size = bytes;
+    mtrace_cache_ways = ways;
+    return 0;
+}
+
+static int mtrace_cache_active(void)
+{
+    return mtrace_cache_ways && mtrace_cline_track &&
+	mtrace_mode == mtrace_record_movement;
+}
+
+int mtrace_granularity_set(uint64_t bytes)
+{
+    int shift;
+
+    if (bytes < 8 || bytes > TARGET_PAGE_SIZE || (bytes & (bytes - 1)))
+	return -1;
+    for (shift = 3; (1ULL << shift) < bytes; shift++)
+	;
+    mtrace_cline_shift = shift;
+    return 0;
+}
+
+/* The segment index lives next to the log, in path.idx */
+static void mtrace_index_open(const char *path)
+{
+    char *name = qemu_malloc(strlen(path) + sizeof(".idx"));
+
+    sprintf(name, "%s.idx", path);
+    mtrace_index = fopen(name, "w");
+    if (mtrace_index == NULL)
+	perror("mtrace: segment index");
+    qemu_free(name);
+}
+
+void mtrace_compress_set(int level)
+{
+    mtrace_compress_level = level;
+}
+
+void mtrace_format_set(int format)
+{
+    mtrace_format = format;
+}
+
+/*
+ * The writer's own counters for mtrace_stats_entry.  Only the writer
+ * updates them; anyone else only reads them for a rough report.
+ */
+static uint64_t mtrace_bytes_in;
+static uint64_t mtrace_bytes_out;
+static uint64_t mtrace_write_ns;
+
+static void write_all(int fd, const void *data, size_t len)
+{
+    int64_t start = get_clock();
+
+    mtrace_bytes_out += len;
+    while (len) {
+	ssize_t r = write(fd, data, len);
+	if (r < 0) {
+	    if (errno == EINTR)
+		continue;
+	    perror("write_all: write");
+	    abort();
+	}
+	len -= r;
+	data += r;
+    }
+    mtrace_write_ns += get_clock() - start;
+}
+
+/*
+ * Unless the log goes to a FIFO, the writer thread collects it into
+ * chunks and a few worker threads compress each chunk into its own
+ * gzip member.  The writer writes the members out in order;
+ * concatenated members are still a valid gzip file, so gzopen reads
+ * the log as before.
+ */
+enum {
+    mtrace_chunk_free = 0,
+    mtrace_chunk_queued,
+    mtrace_chunk_busy,
+    mtrace_chunk_done,
+};
+
+struct mtrace_chunk {
+    uint8_t *in;
+    size_t in_len;
+    uint8_t *out;
+    size_t out_len;
+    int state;
+    /* Set if this chunk starts a segment, for the index */
+    int segment;
+    uint64_t segment_count;
+    char segment_name[64];
+};
+
+static struct mtrace_chunk mtrace_chunks[2 * MTRACE_COMPRESS_MAX_THREADS];
+static int mtrace_nchunks;
+static int mtrace_chunk_fill;	/* Being filled by the writer */
+static int mtrace_chunk_work;	/* Next for a worker to compress */
+static int mtrace_chunk_write;	/* Next to write out */
+static int mtrace_chunks_pending;	/* Submitted but not written out */
+static size_t mtrace_chunk_out_size;
+static uint64_t mtrace_file_offset;	/* Of the next chunk written out */
+
+static pthread_t mtrace_compress_threads[MTRACE_COMPRESS_MAX_THREADS];
+static int mtrace_ncompress_threads;
+static pthread_mutex_t mtrace_compress_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mtrace_compress_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t mtrace_compress_done_cond = PTHREAD_COND_INITIALIZER;
+static int mtrace_compress_stop;
+
+static void mtrace_chunk_compress(struct mtrace_chunk *c)
+{
+    z_stream z;
+
+    memset(&z, 0, sizeof(z));
+    /* 16 + MAX_WBITS asks for a gzip header */
+    if (deflateInit2(&z, mtrace_compress_level, Z_DEFLATED,
+		     16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+	fprintf(stderr, "mtrace: deflateInit2 failed\n");
+	abort();
+    }
+    z.next_in = c->in;
+    z.avail_in = c->in_len;
+    z.next_out = c->out;
+    z.avail_out = mtrace_chunk_out_size;
+    if (deflate(&z, Z_FINISH) != Z_STREAM_END) {
+	fprintf(stderr, "mtrace: deflate failed\n");
+	abort();
+    }
+    c->out_len = z.total_out;
+    deflateEnd(&z);
+}
+
+static void *mtrace_compress_main(void *arg)
+{
+    struct mtrace_chunk *c;
+
+    pthread_mutex_lock(&mtrace_compress_lock);
+    for (;;) {
+	c = &mtrace_chunks[mtrace_chunk_work];
+	if (c->state != mtrace_chunk_queued) {
+	    if (mtrace_compress_stop)
+		break;
+	    pthread_cond_wait(&mtrace_compress_work_cond,
+			      &mtrace_compress_lock);
+	    continue;
+	}
+	c->state = mtrace_chunk_busy;
+	mtrace_chunk_work = (mtrace_chunk_work + 1) % mtrace_nchunks;
+	pthread_mutex_unlock(&mtrace_compress_lock);
+
+	mtrace_chunk_compress(c);
+
+	pthread_mutex_lock(&mtrace_compress_lock);
+	c->state = mtrace_chunk_done;
+	pthread_cond_signal(&mtrace_compress_done_cond);
+    }
+    pthread_mutex_unlock(&mtrace_compress_lock);
+    return NULL;
+}
+
+/* Write out compressed chunks in order, waiting for at least min of
+ * them to finish compressing. */
+static void mtrace_chunks_write(int min)
+{
+    struct mtrace_chunk *c;
+
+    pthread_mutex_lock(&mtrace_compress_lock);
+    while (mtrace_chunks_pending) {
+	c = &mtrace_chunks[mtrace_chunk_write];
+	if (c->state != mtrace_chunk_done) {
+	    if (min <= 0)
+		break;
+	    pthread_cond_wait(&mtrace_compress_done_cond,
+			      &mtrace_compress_lock);
+	    continue;
+	}
+	pthread_mutex_unlock(&mtrace_compress_lock);
+	if (c->segment && mtrace_index) {
+	    fprintf(mtrace_index, "%"PRIu64" %"PRIu64" %s\n",
+		    mtrace_file_offset, c->segment_count, c->segment_name);
+	    fflush(mtrace_index);
+	}
+	write_all(mtrace_file, c->out, c->out_len);
+	mtrace_file_offset += c->out_len;
+	pthread_mutex_lock(&mtrace_compress_lock);
+	c->in_len = 0;
+	c->segment = 0;
+	c->state = mtrace_chunk_free;
+	mtrace_chunk_write = (mtrace_chunk_write + 1) % mtrace_nchunks;
+	mtrace_chunks_pending--;
+	min--;
+    }
+    pthread_mutex_unlock(&mtrace_compress_lock);
+}
+
+/* Hand the chunk being filled to the workers and start on the next
+ * one, which may mean waiting for it to be written out. */
+static void mtrace_chunk_submit(void)
+{
+    struct mtrace_chunk *c = &mtrace_chunks[mtrace_chunk_fill];
+
+    pthread_mutex_lock(&mtrace_compress_lock);
+    c->state = mtrace_chunk_queued;
+    mtrace_chunk_fill = (mtrace_chunk_fill + 1) % mtrace_nchunks;
+    mtrace_chunks_pending++;
+    pthread_cond_signal(&mtrace_compress_work_cond);
+    pthread_mutex_unlock(&mtrace_compress_lock);
+
+    /* If every chunk is in flight, the one we want is the oldest */
+    mtrace_chunks_write(mtrace_chunks_pending == mtrace_nchunks);
+}
+
+static void mtrace_compress_start(void)
+{
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    mtrace_ncompress_threads = ncpus < 1 ? 1 :
+	(ncpus > MTRACE_COMPRESS_MAX_THREADS ?
+	 MTRACE_COMPRESS_MAX_THREADS : ncpus);
+    mtrace_nchunks = 2 * mtrace_ncompress_threads;
+    /* Room for the gzip header and trailer, too */
+    mtrace_chunk_out_size = compressBound(MTRACE_CHUNK_BYTES) + 64;
+    for (i = 0; i < mtrace_nchunks; i++) {
+	mtrace_chunks[i].in = qemu_malloc(MTRACE_CHUNK_BYTES);
+	mtrace_chunks[i].out = qemu_malloc(mtrace_chunk_out_size);
+    }
+    /* Called with signals blocked by mtrace_writer_start */
+    for (i = 0; i < mtrace_ncompress_threads; i++) {
+	if (pthread_create(&mtrace_compress_threads[i], NULL,
+			   mtrace_compress_main, NULL)) {
+	    perror("mtrace: pthread_create");
+	    abort();
+	}
+    }
+}
+
+static void mtrace_compress_finish(void)
+{
+    int i;
+
+    if (mtrace_chunks[mtrace_chunk_fill].in_len)
+	mtrace_chunk_submit();
+    mtrace_chunks_write(mtrace_nchunks);
+
+    pthread_mutex_lock(&mtrace_compress_lock);
+    mtrace_compress_stop = 1;
+    pthread_cond_broadcast(&mtrace_compress_work_cond);
+    pthread_mutex_unlock(&mtrace_compress_lock);
+    for (i = 0; i < mtrace_ncompress_threads; i++)
+	pthread_join(mtrace_compress_threads[i], NULL);
+}
+
+/* Log bytes since the current segment started */
+static uint64_t mtrace_segment_bytes;
+
+/* Append to the log */
+static void mtrace_out(const void *data, size_t len)
+{
+    static uint8_t flush_buffer[FLUSH_BUFFER_BYTES];
+    static size_t n;
+    struct mtrace_chunk *c;
+
+    mtrace_bytes_in += len;
+    mtrace_segment_bytes += len;
+    if (mtrace_file_fifo) {
+	if (data == NULL || n + len > FLUSH_BUFFER_BYTES) {
+	    write_all(mtrace_file, flush_buffer, n);
+	    n = 0;
+	}
+	if (data) {
+	    memcpy(&flush_buffer[n], data, len);
+	    n += len;
+	}
+	return;
+    }
+
+    if (data == NULL) {
+	/* Not worth a gzip member; just write out what's done */
+	mtrace_chunks_write(0);
+	return;
+    }
+    c = &mtrace_chunks[mtrace_chunk_fill];
+    if (c->in_len + len > MTRACE_CHUNK_BYTES) {
+	mtrace_chunk_submit();
+	c = &mtrace_chunks[mtrace_chunk_fill];
+    }
+    memcpy(&c->in[c->in_len], data, len);
+    c->in_len += len;
+}
+
+/*
+ * MTRACE_FORMAT_V2 compact access records (see mtrace-magic.h).  The
+ * writer thread encodes them, so the previous access state is private
+ * to it.
+ */
+struct mtrace_compact_cpu {
+    uint64_t pc;
+    uint64_t host_addr;
+    uint64_t guest_addr;
+    uint32_t stack_id;
+    uint64_t ts;
+};
+
+static struct mtrace_compact_cpu *mtrace_compact_cpus;
+static uint16_t mtrace_compact_cpu;
+static uint64_t mtrace_compact_count;
+
+static uint8_t *mtrace_put_varint(uint8_t *p, uint64_t v)
+{
+    while (v >= 0x80) {
+	*p++ = v | 0x80;
+	v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+static uint8_t *mtrace_put_zigzag(uint8_t *p, uint64_t v, uint64_t prev)
+{
+    int64_t d = v - prev;
+
+    return mtrace_put_varint(p, (d << 1) ^ (d >> 63));
+}
+
+static void mtrace_out_access(struct mtrace_access_entry *a)
+{
+    /* Tag, cpu, access_count, 3 addresses, ts, bytes, cache */
+    uint8_t buf[1 + 3 + 5 * 10 + 1 + 3];
+    struct mtrace_compact_cpu *c = &mtrace_compact_cpus[a->h.cpu];
+    uint8_t *p = &buf[1];
+    int cache = mtrace_format >= MTRACE_FORMAT_V6 && mtrace_cache_ways;
+
+    if ((a->h.ts != 0 && mtrace_format < MTRACE_FORMAT_V5) ||
+	(a->cache != mtrace_cache_none && !cache) ||
+	a->stack_id != c->stack_id) {
+	mtrace_out(a, a->h.size);
+    } else {
+	buf[0] = MTRACE_COMPACT_TAG | a->access_type |
+	    (a->traffic ? MTRACE_COMPACT_TRAFFIC : 0) |
+	    (a->lock ? MTRACE_COMPACT_LOCK : 0) |
+	    (a->deps ? MTRACE_COMPACT_DEPS : 0);
+	if (a->h.cpu != mtrace_compact_cpu) {
+	    buf[0] |= MTRACE_COMPACT_CPU;
+	    p = mtrace_put_varint(p, a->h.cpu);
+	}
+	if (a->h.access_count != mtrace_compact_count) {
+	    buf[0] |= MTRACE_COMPACT_COUNT;
+	    p = mtrace_put_zigzag(p, a->h.access_count, mtrace_compact_count);
+	}
+	p = mtrace_put_zigzag(p, a->pc, c->pc);
+	p = mtrace_put_zigzag(p, a->host_addr, c->host_addr);
+	p = mtrace_put_zigzag(p, a->guest_addr, c->guest_addr);
+	if (mtrace_format >= MTRACE_FORMAT_V5)
+	    p = mtrace_put_zigzag(p, a->h.ts, c->ts);
+	*p++ = a->bytes;
+	if (cache)
+	    p = mtrace_put_varint(p, a->cache | (uint64_t)a->cache_cpu << 2);
+	mtrace_out(buf, p - buf);
+    }
+
+    c->pc = a->pc;
+    c->host_addr = a->host_addr;
+    c->guest_addr = a->guest_addr;
+    c->stack_id = a->stack_id;
+    c->ts = a->h.ts;
+    mtrace_compact_cpu = a->h.cpu;
+    mtrace_compact_count = a->h.access_count + 1;
+}
+
+/*
+ * MTRACE_FORMAT_V3 name interning, also private to the writer thread.
+ * An open-addressed table from name to id; id 0 marks a free slot.
+ */
+#define MTRACE_NAME_BYTES	64
+
+struct mtrace_string {
+    char str[MTRACE_NAME_BYTES];
+    uint32_t id;
+};
+
+static struct mtrace_string *mtrace_strings;
+static uint32_t mtrace_strings_size;
+static uint32_t mtrace_nstrings;
+
+static uint32_t mtrace_string_hash(const char *str, size_t len)
+{
+    uint32_t h = 2166136261U;	/* FNV-1a */
+    size_t i;
+
+    for (i = 0; i < len; i++)
+	h = (h ^ (uint8_t)str[i]) * 16777619U;
+    return h;
+}
+
+static struct mtrace_string *mtrace_string_slot(const char *str, size_t len)
+{
+    uint32_t i = mtrace_string_hash(str, len) & (mtrace_strings_size - 1);
+
+    while (mtrace_strings[i].id &&
+	   strncmp(mtrace_strings[i].str, str, MTRACE_NAME_BYTES))
+	i = (i + 1) & (mtrace_strings_size - 1);
+    return &mtrace_strings[i];
+}
+
+static void mtrace_strings_grow(void)
+{
+    struct mtrace_string *old = mtrace_strings;
+    uint32_t old_size = mtrace_strings_size;
+    uint32_t i;
+
+    mtrace_strings_size = old_size ? old_size * 2 : 1024;
+    mtrace_strings = qemu_mallocz(mtrace_strings_size *
+				  sizeof(mtrace_strings[0]));
+    for (i = 0; i < old_size; i++) {
+	const char *str = old[i].str;
+	if (old[i].id)
+	    *mtrace_string_slot(str, qemu_strnlen(str, MTRACE_NAME_BYTES)) = old[i];
+    }
+    qemu_free(old);
+}
+
+/* Returns name's id, logging it first if it's new */
+static uint32_t mtrace_string_intern(const char *name,
+				     struct mtrace_entry_header *h)
+{
+    size_t len = qemu_strnlen(name, MTRACE_NAME_BYTES);
+    struct mtrace_string_entry entry;
+    struct mtrace_string *s;
+
+    if (mtrace_nstrings * 2 >= mtrace_strings_size)
+	mtrace_strings_grow();
+    s = mtrace_string_slot(name, len);
+    if (s->id)
+	return s->id;
+
+    memset(s->str, 0, sizeof(s->str));
+    memcpy(s->str, name, len);
+    s->id = ++mtrace_nstrings;
+
+    entry.h.type = mtrace_entry_string;
+    entry.h.size = offsetof(struct mtrace_string_entry, str) +
+	(len < MTRACE_NAME_BYTES ? len + 1 : len);
+    entry.h.cpu = h->cpu;
+    entry.h.access_count = h->access_count;
+    entry.h.ts = 0;
+    entry.id = s->id;
+    memcpy(entry.str, s->str, sizeof(entry.str));
+    mtrace_out(&entry, entry.h.size);
+    return s->id;
+}
+
+static void mtrace_out_named(union mtrace_entry *entry, unsigned int off)
+{
+    union mtrace_entry out;
+    uint8_t *p = (uint8_t *)&out;
+    uint32_t id;
+
+    if (entry->h.size < off + MTRACE_NAME_BYTES) {
+	/* Too short to hold the name */
+	mtrace_out(entry, entry->h.size);
+	return;
+    }
+
+    id = mtrace_string_intern((char *)entry + off, &entry->h);
+    memcpy(p, entry, off);
+    memcpy(p + off, &id, sizeof(id));
+    memcpy(p + off + sizeof(id), (uint8_t *)entry + off + MTRACE_NAME_BYTES,
+	   entry->h.size - off - MTRACE_NAME_BYTES);
+    out.h.type |= MTRACE_ENTRY_INTERNED;
+    out.h.size = entry->h.size - MTRACE_NAME_BYTES + sizeof(id);
+    mtrace_out(&out, out.h.size);
+}
+
+/*
+ * The log is a series of segments that decode on their own.  Each
+ * starts a new gzip member with the compact access and string state
+ * reset, and begins with a machine entry (which tells readers to reset
+ * theirs too).  A call stack, and its parents, are logged again in a
+ * segment before the first entry there that uses it.  Every machine
+ * entry and every mode switch starts a segment, as does passing
+ * mtrace_segment_size bytes.  The index records each segment's file
+ * offset, first access_count and the name of the mode it was cut at.
+ */
+static struct mtrace_machine_entry mtrace_segment_machine;
+static struct mtrace_stack_entry *mtrace_segment_stacks;
+static uint8_t *mtrace_segment_stacks_out;	/* Logged in this segment */
+static uint32_t mtrace_segment_nstacks = 1;
+static uint32_t mtrace_segment_stacks_size;
+static char mtrace_segment_name[64] = "-";
+
+/* Logs stack id, after its parents, unless this segment already has it */
+static void mtrace_segment_stack_out(uint32_t id)
+{
+    uint32_t top, parent;
+
+    if (id >= mtrace_segment_nstacks)
+	return;
+    while (id && !mtrace_segment_stacks_out[id]) {
+	for (top = id; ; top = parent) {
+	    parent = mtrace_segment_stacks[top].parent;
+	    if (parent == 0 || mtrace_segment_stacks_out[parent])
+		break;
+	}
+	mtrace_out(&mtrace_segment_stacks[top], sizeof(mtrace_segment_stacks[top]));
+	mtrace_segment_stacks_out[top] = 1;
+    }
+}
+
+static void mtrace_segment_start(union mtrace_entry *entry)
+{
+    struct mtrace_chunk *c;
+
+    if (!mtrace_file_fifo) {
+	if (mtrace_chunks[mtrace_chunk_fill].in_len)
+	    mtrace_chunk_submit();
+	c = &mtrace_chunks[mtrace_chunk_fill];
+	c->segment = 1;
+	c->segment_count = entry->h.access_count;
+	memcpy(c->segment_name, mtrace_segment_name, sizeof(c->segment_name));
+    }
+
+    memset(mtrace_compact_cpus, 0, smp_cpus * sizeof(mtrace_compact_cpus[0]));
+    mtrace_compact_cpu = 0;
+    mtrace_compact_count = 0;
+    if (mtrace_strings)
+	memset(mtrace_strings, 0,
+	       mtrace_strings_size * sizeof(mtrace_strings[0]));
+    mtrace_nstrings = 0;
+    mtrace_segment_bytes = 0;
+
+    if (mtrace_segment_stacks_out)
+	memset(mtrace_segment_stacks_out, 0, mtrace_segment_nstacks);
+
+    mtrace_out(&mtrace_segment_machine, mtrace_segment_machine.h.size);
+}
+
+/* Starts a segment if entry should be the first in one.  Returns 1 if
+ * that already logged entry. */
+static int mtrace_segment_check(union mtrace_entry *entry)
+{
+    struct mtrace_host_entry *h = &entry->host;
+
+    switch (entry->h.type) {
+    case mtrace_entry_machine:
+	memset(&mtrace_segment_machine, 0, sizeof(mtrace_segment_machine));
+	memcpy(&mtrace_segment_machine, entry,
+	       MIN(entry->h.size, sizeof(mtrace_segment_machine)));
+	mtrace_segment_start(entry);
+	return 1;
+    case mtrace_entry_stack:
+	if (entry->stack.id != mtrace_segment_nstacks)
+	    break;
+	if (mtrace_segment_nstacks >= mtrace_segment_stacks_size) {
+	    mtrace_segment_stacks_size = mtrace_segment_stacks_size ?
+		mtrace_segment_stacks_size * 2 : 1024;
+	    mtrace_segment_stacks = qemu_realloc(mtrace_segment_stacks,
+		mtrace_segment_stacks_size * sizeof(mtrace_segment_stacks[0]));
+	    mtrace_segment_stacks_out = qemu_realloc(mtrace_segment_stacks_out,
+						     mtrace_segment_stacks_size);
+	}
+	mtrace_segment_stacks[mtrace_segment_nstacks] = entry->stack;
+	mtrace_segment_stacks_out[mtrace_segment_nstacks++] = 0;
+	break;
+    case mtrace_entry_host:
+	if (mtrace_file_fifo || h->host_type != mtrace_access_all_cpu)
+	    break;
+	if (h->access.mode == mtrace_record_disable || !h->access.str[0])
+	    pstrcpy(mtrace_segment_name, sizeof(mtrace_segment_name), "-");
+	else
+	    pstrcpy(mtrace_segment_name, sizeof(mtrace_segment_name),
+		    (const char *)h->access.str);
+	mtrace_segment_start(entry);
+	return 0;
+    default:
+	break;
+    }
+    if (!mtrace_file_fifo && mtrace_segment_bytes >= mtrace_segment_size)
+	mtrace_segment_start(entry);
+    return 0;
+}
+
+static void mtrace_out_entry(union mtrace_entry *entry)
+{
+    unsigned int name_off = mtrace_entry_name_offset(entry->h.type);
+
+    if (mtrace_segment_check(entry))
+	return;
+
+    if (entry->h.type == mtrace_entry_stack) {
+	/* Logged below, but readers need its parents first */
+	mtrace_segment_stack_out(entry->stack.parent);
+	if (entry->stack.id < mtrace_segment_nstacks)
+	    mtrace_segment_stacks_out[entry->stack.id] = 1;
+    } else if (entry->h.type == mtrace_entry_access) {
+	mtrace_segment_stack_out(entry->access.stack_id);
+    }
+    if (entry->h.type == mtrace_entry_stats) {
+	entry->stats.bytes_in = mtrace_bytes_in;
+	entry->stats.bytes_out = mtrace_bytes_out;
+	entry->stats.write_ns = mtrace_write_ns;
+    }
+    if (mtrace_format >= MTRACE_FORMAT_V2 &&
+	entry->h.type == mtrace_entry_access)
+	mtrace_out_access(&entry->access);
+    else if (mtrace_format >= MTRACE_FORMAT_V3 && name_off)
+	mtrace_out_named(entry, name_off);
+    else
+	mtrace_out(entry, entry->h.size);
+}
+
+/*
+ * Log entries go into a ring per CPU and a writer thread ships them to
+ * gzip, so a slow gzip only stalls the guest once a ring fills up.
+ * Each record is a sequence number followed by the entry, padded to 8
+ * bytes.  All CPUs run in the one TCG thread, so records are published
+ * in sequence order and the writer restores the exact order in which
+ * entries were logged (and hence access_count order) by always taking
+ * the next sequence number.
+ */
+#define MTRACE_RING_PAD		(~0ULL)	/* Skip to the start of the ring */
+
+struct mtrace_ring {
+    uint8_t *buf;
+    uint64_t size;
+    volatile uint64_t head;	/* Consumed by the writer */
+    volatile uint64_t tail;	/* Published by the producer */
+};
+
+static struct mtrace_ring *mtrace_rings;
+static int mtrace_nrings;
+static uint64_t mtrace_ring_bytes = MTRACE_RING_BYTES;
+static uint64_t mtrace_log_seq;
+
+static pthread_t mtrace_writer;
+static pthread_mutex_t mtrace_writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mtrace_writer_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t mtrace_space_cond = PTHREAD_COND_INITIALIZER;
+static volatile int mtrace_writer_idle;
+static volatile int mtrace_producer_waiting;
+static volatile int mtrace_writer_done;
+
+/* mtrace_writer_sync requests, and the last one the writer finished */
+static pthread_cond_t mtrace_sync_cond = PTHREAD_COND_INITIALIZER;
+static volatile uint64_t mtrace_writer_sync_req;
+static uint64_t mtrace_writer_synced;
+
+/* Backpressure: times the TCG thread waited for the writer, and for
+ * how long */
+static uint64_t mtrace_ring_stalls;
+static uint64_t mtrace_ring_stall_ns;
+
+/* What the TCG thread did on behalf of each CPU */
+struct mtrace_cpu_stats {
+    uint64_t entries[MTRACE_STATS_TYPES];
+    uint64_t sample_drops;
+    uint64_t get_pc;
+    uint64_t get_pc_slow;
+    uint64_t rw_debug;
+    uint64_t cache[4];		/* By mtrace_cache_t */
+    uint64_t filter_drops;
+};
+
+static struct mtrace_cpu_stats mtrace_cpu_stats[255];
+
+void mtrace_buffer_set(uint64_t bytes)
+{
+    uint64_t size = 1 << 16;
+
+    /* Round up to a power of two, big enough for any entry */
+    while (size < bytes)
+	size <<= 1;
+    mtrace_ring_bytes = size;
+}
+
+static inline uint64_t mtrace_ring_record_size(uint16_t size)
+{
+    return sizeof(uint64_t) + ((size + 7) & ~7);
+}
+
+static void mtrace_ring_wait_space(struct mtrace_ring *ring, uint64_t need)
+{
+    int64_t start = get_clock();
+
+    mtrace_ring_stalls++;
+    pthread_mutex_lock(&mtrace_writer_lock);
+    mtrace_producer_waiting = 1;
+    __sync_synchronize();
+    while (ring->size - (ring->tail - ring->head) < need) {
+	pthread_cond_signal(&mtrace_writer_cond);
+	pthread_cond_wait(&mtrace_space_cond, &mtrace_writer_lock);
+    }
+    mtrace_producer_waiting = 0;
+    pthread_mutex_unlock(&mtrace_writer_lock);
+    mtrace_ring_stall_ns += get_clock() - start;
+}
+
+static void mtrace_log_entry(union mtrace_entry *entry)
+{
+    struct mtrace_ring *ring = &mtrace_rings[entry->h.cpu % mtrace_nrings];
+    uint64_t len = mtrace_ring_record_size(entry->h.size);
+    uint64_t off, contig;
+
+    /* The guest logged anything in its ring before this */
+    if (mtrace_guest_nrings)
+	mtrace_guest_ring_drain(entry->h.cpu, entry->h.access_count);
+    if (entry->h.type < MTRACE_STATS_TYPES)
+	mtrace_cpu_stats[entry->h.cpu].entries[entry->h.type]++;
+
+    off = ring->tail & (ring->size - 1);
+    contig = ring->size - off;
+
+    if (ring->size - (ring->tail - ring->head) <
+	len + (contig < len ? contig : 0))
+	mtrace_ring_wait_space(ring, len + (contig < len ? contig : 0));
+
+    if (contig < len) {
+	*(uint64_t *)&ring->buf[off] = MTRACE_RING_PAD;
+	ring->tail += contig;
+	off = 0;
+    }
+    *(uint64_t *)&ring->buf[off] = mtrace_log_seq++;
+    memcpy(&ring->buf[off + sizeof(uint64_t)], entry, entry->h.size);
+    smp_wmb();
+    ring->tail += len;
+
+    /* Wake the writer if it went to sleep (pairs with mtrace_writer_wait) */
+    __sync_synchronize();
+    if (mtrace_writer_idle) {
+	pthread_mutex_lock(&mtrace_writer_lock);
+	pthread_cond_signal(&mtrace_writer_cond);
+	pthread_mutex_unlock(&mtrace_writer_lock);
+    }
+}
+
+/* Returns the sequence number of ring's next record, or MTRACE_RING_PAD
+ * if it's empty */
+static uint64_t mtrace_ring_peek(struct mtrace_ring *ring)
+{
+    uint64_t off, seq;
+
+    for (;;) {
+	if (ring->head == ring->tail)
+	    return MTRACE_RING_PAD;
+	barrier();
+	off = ring->head & (ring->size - 1);
+	seq = *(uint64_t *)&ring->buf[off];
+	if (seq != MTRACE_RING_PAD)
+	    return seq;
+	ring->head += ring->size - off;
+    }
+}
+
+static int mtrace_rings_empty(void)
+{
+    int i;
+
+    for (i = 0; i < mtrace_nrings; i++)
+	if (mtrace_rings[i].head != mtrace_rings[i].tail)
+	    return 0;
+    return 1;
+}
+
+/* Returns 0 once the producer is done and everything is written */
+static int mtrace_writer_wait(void)
+{
+    int more;
+
+    pthread_mutex_lock(&mtrace_writer_lock);
+    mtrace_writer_idle = 1;
+    __sync_synchronize();
+    while (mtrace_rings_empty() && !mtrace_writer_done &&
+	   mtrace_writer_sync_req == mtrace_writer_synced)
+	pthread_cond_wait(&mtrace_writer_cond, &mtrace_writer_lock);
+    mtrace_writer_idle = 0;
+    more = !mtrace_rings_empty() || !mtrace_writer_done;
+    pthread_mutex_unlock(&mtrace_writer_lock);
+    return more;
+}
+
+/* Write out everything, even a partly filled chunk, for a sync */
+static void mtrace_writer_sync_ack(void)
+{
+    uint64_t req = mtrace_writer_sync_req;
+
+    if (!mtrace_file_fifo) {
+	if (mtrace_chunks[mtrace_chunk_fill].in_len)
+	    mtrace_chunk_submit();
+	mtrace_chunks_write(mtrace_nchunks);
+    }
+    pthread_mutex_lock(&mtrace_writer_lock);
+    mtrace_writer_synced = req;
+    pthread_cond_broadcast(&mtrace_sync_cond);
+    pthread_mutex_unlock(&mtrace_writer_lock);
+}
+
+static void *mtrace_writer_main(void *arg)
+{
+    uint64_t next_seq = 0;
+    struct mtrace_ring *ring = &mtrace_rings[0];
+    union mtrace_entry *entry;
+    int i;
+
+    for (;;) {
+	/* Usually the same CPU logs several entries in a row */
+	if (mtrace_ring_peek(ring) != next_seq) {
+	    for (i = 0; i < mtrace_nrings; i++)
+		if (mtrace_ring_peek(&mtrace_rings[i]) == next_seq)
+		    break;
+	    if (i == mtrace_nrings) {
+		if (!mtrace_rings_empty()) {
+		    fprintf(stderr, "mtrace: log record %"PRIu64" missing\n",
+			    next_seq);
+		    abort();
+		}
+		/* Nothing to do, so write out what we have */
+		mtrace_out(NULL, 0);
+		if (mtrace_writer_sync_req != mtrace_writer_synced)
+		    mtrace_writer_sync_ack();
+		if (!mtrace_writer_wait())
+		    break;
+		continue;
+	    }
+	    ring = &mtrace_rings[i];
+	}
+
+	entry = (union mtrace_entry *)
+	    &ring->buf[(ring->head & (ring->size - 1)) + sizeof(uint64_t)];
+	mtrace_out_entry(entry);
+
+	__sync_synchronize();
+	ring->head += mtrace_ring_record_size(entry->h.size);
+	next_seq++;
+
+	__sync_synchronize();
+	if (mtrace_producer_waiting) {
+	    pthread_mutex_lock(&mtrace_writer_lock);
+	    pthread_cond_signal(&mtrace_space_cond);
+	    pthread_mutex_unlock(&mtrace_writer_lock);
+	}
+    }
+
+    if (!mtrace_file_fifo)
+	mtrace_compress_finish();
+    return NULL;
+}
+
+static void mtrace_writer_start(void)
+{
+    sigset_t set, oldset;
+    int i;
+
+    mtrace_nrings = smp_cpus;
+    mtrace_rings = qemu_mallocz(mtrace_nrings * sizeof(mtrace_rings[0]));
+    for (i = 0; i < mtrace_nrings; i++) {
+	mtrace_rings[i].buf = qemu_malloc(mtrace_ring_bytes);
+	mtrace_rings[i].size = mtrace_ring_bytes;
+    }
+    mtrace_compact_cpus = qemu_mallocz(smp_cpus *
+				       sizeof(mtrace_compact_cpus[0]));
+
+    /* Leave signals to the TCG thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+    if (!mtrace_file_fifo) {
+	mtrace_compress_start();
+	mtrace_index_open(mtrace_file_path);
+    }
+    if (pthread_create(&mtrace_writer, NULL, mtrace_writer_main, NULL)) {
+	perror("mtrace: pthread_create");
+	abort();
+    }
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+}
+
+/*
+ * Wait for the writer to write out everything logged so far.  Returns
+ * with mtrace_writer_lock held and the writer idle, so the caller can
+ * change the writer's state before mtrace_writer_resume.
+ */
+static void mtrace_writer_sync(void)
+{
+    uint64_t req;
+
+    pthread_mutex_lock(&mtrace_writer_lock);
+    req = ++mtrace_writer_sync_req;
+    pthread_cond_signal(&mtrace_writer_cond);
+    while (mtrace_writer_synced != req)
+	pthread_cond_wait(&mtrace_sync_cond, &mtrace_writer_lock);
+}
+
+static void mtrace_writer_resume(void)
+{
+    pthread_mutex_unlock(&mtrace_writer_lock);
+}
+
+/* Wait for the writer to write out every ring */
+static void mtrace_writer_stop(void)
+{
+    pthread_mutex_lock(&mtrace_writer_lock);
+    mtrace_writer_done = 1;
+    pthread_cond_signal(&mtrace_writer_cond);
+    pthread_mutex_unlock(&mtrace_writer_lock);
+    pthread_join(mtrace_writer, NULL);
+
+    if (mtrace_ring_stalls)
+	fprintf(stderr, "mtrace: waited for the log writer %"PRIu64
+		" times (%"PRIu64" ms)\n", mtrace_ring_stalls,
+		mtrace_ring_stall_ns / 1000000);
+}
+
+/* Tags are mostly aligned kernel addresses, so mix in the high bits */
+static inline uint64_t mtrace_per_call_stack_home(uint64_t tag)
+{
+    return (tag * 0x9e3779b97f4a7c15ULL) >> (64 - mtrace_per_call_stack_bits);
+}
+
+/* Returns tag's slot, or the free slot where it belongs */
+static struct mtrace_call_stack_info *mtrace_per_call_stack_slot(uint64_t tag)
+{
+    uint64_t mask = (1ULL << mtrace_per_call_stack_bits) - 1;
+    uint64_t i = mtrace_per_call_stack_home(tag);
+    struct mtrace_call_stack_info *cs;
+
+    mtrace_call_stack_stats.lookups++;
+    for (;; i = (i + 1) & mask) {
+	mtrace_call_stack_stats.probes++;
+	cs = &mtrace_per_call_stack[i];
+	if (cs->tag == tag || cs->tag == 0)
+	    return cs;
+    }
+}
+
+static void mtrace_per_call_stack_grow(void)
+{
+    struct mtrace_call_stack_info *old = mtrace_per_call_stack;
+    uint64_t i, j, mask, n = old ? 1ULL << mtrace_per_call_stack_bits : 0;
+
+    mtrace_per_call_stack_bits = old ? mtrace_per_call_stack_bits + 1 : 10;
+    mtrace_per_call_stack = qemu_mallocz(sizeof(*old) <<
+					 mtrace_per_call_stack_bits);
+    mask = (1ULL << mtrace_per_call_stack_bits) - 1;
+    for (i = 0; i < n; i++) {
+	if (old[i].tag == 0)
+	    continue;
+	for (j = mtrace_per_call_stack_home(old[i].tag);
+	     mtrace_per_call_stack[j].tag; j = (j + 1) & mask)
+	    ;
+	mtrace_per_call_stack[j] = old[i];
+    }
+    qemu_free(old);
+    if (old)
+	mtrace_call_stack_stats.grows++;
+}
+
+/*
+ * Returns the call stack for tag, adding it if it's new.  The pointer
+ * is only good until the next add or delete.
+ */
+static struct mtrace_call_stack_info *mtrace_get_per_call_stack(uint64_t tag)
+{
+    struct mtrace_call_stack_info *cs;
+
+    if ((mtrace_call_stack_stats.live + 1) * 2 >
+	(1ULL << mtrace_per_call_stack_bits))
+	mtrace_per_call_stack_grow();
+    cs = mtrace_per_call_stack_slot(tag);
+    if (cs->tag == 0) {
+	*cs = (struct mtrace_call_stack_info){.tag = tag};
+	if (++mtrace_call_stack_stats.live > mtrace_call_stack_stats.peak)
+	    mtrace_call_stack_stats.peak = mtrace_call_stack_stats.live;
+    }
+    return cs;
+}
+
+/*
+ * Removes tag by shifting later entries in its probe run back, so
+ * lookups never need tombstones.
+ */
+static void mtrace_del_per_call_stack(uint64_t tag)
+{
+    uint64_t mask = (1ULL << mtrace_per_call_stack_bits) - 1;
+    struct mtrace_call_stack_info *cs;
+    uint64_t i, j, home;
+
+    if (mtrace_per_call_stack == NULL)
+	return;
+    cs = mtrace_per_call_stack_slot(tag);
+    if (cs->tag == 0)
+	return;
+    qemu_free(cs->seen);
+
+    i = cs - mtrace_per_call_stack;
+    for (j = (i + 1) & mask; mtrace_per_call_stack[j].tag;
+	 j = (j + 1) & mask) {
+	/* Move j into the hole unless its home is in (i, j] */
+	home = mtrace_per_call_stack_home(mtrace_per_call_stack[j].tag);
+	if (((j - home) & mask) >= ((j - i) & mask)) {
+	    mtrace_per_call_stack[i] = mtrace_per_call_stack[j];
+	    i = j;
+	}
+    }
+    mtrace_per_call_stack[i].tag = 0;
+    mtrace_call_stack_stats.live--;
+}
+
+static struct mtrace_call_stack_info *mtrace_my_call_stack(int cpu)
+{
+    if (!mtrace_call_stack_tagvalid[cpu])
+	return 0;
+    return mtrace_get_per_call_stack(mtrace_call_stack[cpu]);
+}
+
+static void mtrace_ascope_seen_reset(struct mtrace_call_stack_info *s)
+{
+    if (s->seen_count)
+	memset(s->seen, 0, s->seen_size * sizeof(s->seen[0]));
+    s->seen_count = 0;
+}
+
+static void mtrace_ascope_seen_reset_all(void)
+{
+    uint64_t i;
+
+    if (mtrace_per_call_stack == NULL)
+	return;
+    for (i = 0; i < 1ULL << mtrace_per_call_stack_bits; i++)
+	if (mtrace_per_call_stack[i].tag)
+	    mtrace_ascope_seen_reset(&mtrace_per_call_stack[i]);
+}
+
+static uint64_t *mtrace_ascope_seen_slot(struct mtrace_call_stack_info *s,
+					 uint64_t key)
+{
+    uint32_t i = (key * 0x9e3779b97f4a7c15ULL) >> 32;
+
+    for (;; i++) {
+	i &= s->seen_size - 1;
+	if (s->seen[i] == key || s->seen[i] == 0)
+	    return &s->seen[i];
+    }
+}
+
+/*
+ * Returns 1 the first time s touches the 16-byte granule at host_addr
+ * (reads and writes separately) since it last entered or exited an
+ * ascope.  Accesses apply to every ascope on the stack, so anything
+ * finer than that could hide an access from the innermost one.
+ */
+static int mtrace_ascope_first(struct mtrace_call_stack_info *s,
+			       uint8_t *host_addr, int write)
+{
+    uint64_t key = ((((uintptr_t)host_addr >> 4) << 1) | write) + 1;
+    uint64_t *slot, *old = s->seen;
+    uint32_t i, n = s->seen_size;
+
+    if ((s->seen_count + 1) * 2 > s->seen_size) {
+	s->seen_size = n ? n * 2 : 256;
+	s->seen = qemu_mallocz(s->seen_size * sizeof(s->seen[0]));
+	for (i = 0; i < n; i++)
+	    if (old[i])
+		*mtrace_ascope_seen_slot(s, old[i]) = old[i];
+	qemu_free(old);
+    }
+
+    slot = mtrace_ascope_seen_slot(s, key);
+    if (*slot)
+	return 0;
+    *slot = key;
+    s->seen_count++;
+    return 1;
+}
+
+/* Returns 1 if an access in ascope or kernelscope mode should be logged */
+static int mtrace_ascope_update(uint8_t *host_addr, unsigned int cpu,
+				int write)
+{
+    struct mtrace_call_stack_info *s = mtrace_my_call_stack(cpu);
+
+    if (!s || s->ascope_depth == 0)
+	return 1;
+    return mtrace_ascope_first(s, host_addr, write);
+}
+
+static inline uint64_t mtrace_get_percore_tsc(CPUX86State *env)
+{
+    int cpu = env->cpu_index;
+
+    if (mtrace_count_disable[cpu])
+	return mtrace_count_disable_start[cpu] - mtrace_count_skip[cpu];
+    return env->mtrace_insn_count - mtrace_count_skip[cpu];
+}
+
+/*
+ * Returns the guest PC of the instruction at searched_pc in a TB.  If
+ * ts isn't NULL, also sets *ts to the number of instructions the CPU
+ * has started, up to and including that one.  The TB added all of its
+ * instructions to the count on entry, so that's the count less those
+ * after searched_pc.
+ */
+static unsigned long mtrace_get_pc(unsigned long searched_pc, uint64_t *ts)
+{
+    mtrace_record_mode_t mtrace_mode_save;
+    uint64_t insn_count_save;
+    int rewound_save;
+    TranslationBlock *tb;
+    int insn;
+
+    if (ts)
+	*ts = mtrace_get_percore_tsc(cpu_single_env);
+
+    /*
+     * If searched_pc is NULL, or we can't find a TB, then cpu_single_env->eip 
+     * is (hopefully, probably?) up-to-date.  This happens, for example, when
+     * generating micro ops.
+     */
+    if (searched_pc == 0)
+	return cpu_single_env->eip;
+
+    tb = tb_find_pc(searched_pc);
+    if (!tb)
+	return cpu_single_env->eip;
+
+    mtrace_cpu_stats[cpu_single_env->cpu_index].get_pc++;
+
+    /*
+     * TBs translated while mtrace is enabled carry a map from TCG code
+     * offsets to guest PCs (see cpu_gen_pc_map), so we can just search
+     * it.
+     */
+    if (tb->pc_map) {
+	unsigned long pc = tb_pc_map_lookup(tb, searched_pc, &insn);
+
+	if (ts && !mtrace_count_disable[cpu_single_env->cpu_index])
+	    *ts -= tb->icount - insn - 1;
+	return pc - tb->cs_base;
+    }
+
+    /*
+     * Otherwise, this is pretty heavy weight.  Call cpu_restore_state,
+     * which:
+     *  1. generates the micro ops
+     *  2. finds the offset of the micro op that corresponds to searched_pc's 
+     *     offset in the TCG code of the TB
+     *  3. uses gen_opc_pc to convert the offset of the micro op into a guest 
+     *     PC
+     *  4. updates cpu_single_env->eip
+     *
+     *  NB QEMU reads guest memory while generating micro ops.  We want to
+     *  ignore these accesses, so we temporarily set mtrace_mode to 0.
+     *  cpu_restore_state also rewinds the instruction count to before
+     *  this instruction, which we don't want since the TB keeps running.
+     */
+    mtrace_cpu_stats[cpu_single_env->cpu_index].get_pc_slow++;
+    mtrace_mode_save = mtrace_mode;
+    insn_count_save = cpu_single_env->mtrace_insn_count;
+    rewound_save = cpu_single_env->mtrace_insn_rewound;
+    mtrace_mode = 0;
+    cpu_restore_state(tb, cpu_single_env, searched_pc, NULL);
+    mtrace_mode = mtrace_mode_save;
+    /* This instruction has started */
+    cpu_single_env->mtrace_insn_count++;
+    if (ts)
+	*ts = mtrace_get_percore_tsc(cpu_single_env);
+    cpu_single_env->mtrace_insn_count = insn_count_save;
+    cpu_single_env->mtrace_insn_rewound = rewound_save;
 
-void mtrace_inst_inc(void)
-{
-    if (mtrace_count_disable[cpu_single_env->cpu_index])
-        return;
-    mtrace_inst_count[cpu_single_env->cpu_index]++;
+    return cpu_single_env->eip;
 }
 
-void mtrace_cline_trace_set(int b)
+/*
+ * Called from cpu_loop_exit, which abandons the running TB, e.g.
+ * because a helper raised an exception.  The TB counted all of its
+ * instructions on entry, but only those before env->eip have finished;
+ * the one at eip will be executed (and counted) again.  Software
+ * interrupts finish their instruction.  cpu_restore_state may have
+ * rewound the count already.
+ */
+void mtrace_tb_abort(void)
 {
-    mtrace_cline_track = b;
-}
+    CPUX86State *env = cpu_single_env;
+    TranslationBlock *tb = env->mtrace_tb;
+    mtrace_record_mode_t mtrace_mode_save;
+    target_ulong eip = env->eip;
+    int insn;
 
-void mtrace_lock_trace_set(int b)
-{
-    mtrace_lock_trace = b;
+    /* Not in the middle of a TB (current_tb is the first of a chain) */
+    if (!mtrace_system_enable || env->current_tb == NULL || tb == NULL ||
+	env->mtrace_insn_rewound)
+	return;
+    if (env->exception_index >= 0 && env->exception_index < EXCP_INTERRUPT &&
+	env->exception_is_int)
+	eip = env->exception_next_eip;
+
+    /* As in mtrace_get_pc, ignore the accesses of a retranslation */
+    mtrace_mode_save = mtrace_mode;
+    mtrace_mode = 0;
+    insn = tb_find_insn(env, tb, eip + tb->cs_base);
+    mtrace_mode = mtrace_mode_save;
+    if (insn >= 0)
+	env->mtrace_insn_count -= tb->icount - insn;
+    env->mtrace_insn_rewound = 1;
 }
 
-void mtrace_system_enable_set(int b)
+/*
+ * Per-line, per-CPU counts for mtrace_record_aggregate, open-addressed
+ * on (line, cpu).  A host_addr of 0 marks a free slot.
+ */
+struct mtrace_aggregate_line {
+    uint64_t host_addr;
+    uint64_t guest_addr;
+    uint64_t pc;
+    uint64_t reads;
+    uint64_t writes;
+    uint16_t cpu;
+};
+
+static struct mtrace_aggregate_line *mtrace_aggregate;
+static uint64_t mtrace_aggregate_size;
+static uint64_t mtrace_aggregate_count;
+
+static struct mtrace_aggregate_line *mtrace_aggregate_slot(uint64_t host_addr,
+							   uint16_t cpu)
 {
-    mtrace_system_enable = b;
+    uint64_t h = ((host_addr >> mtrace_cline_shift) ^ ((uint64_t)cpu << 48)) *
+	0x9e3779b97f4a7c15ULL;
+    uint64_t i = (h >> 32) & (mtrace_aggregate_size - 1);
+    struct mtrace_aggregate_line *l;
+
+    for (;; i = (i + 1) & (mtrace_aggregate_size - 1)) {
+	l = &mtrace_aggregate[i];
+	if ((l->host_addr == host_addr && l->cpu == cpu) || l->host_addr == 0)
+	    return l;
+    }
 }
 
-int mtrace_system_enable_get(void)
+static void mtrace_aggregate_grow(void)
 {
-    return mtrace_system_enable;
+    struct mtrace_aggregate_line *old = mtrace_aggregate;
+    uint64_t i, n = mtrace_aggregate_size;
+
+    mtrace_aggregate_size = n ? n * 2 : 1 << 16;
+    mtrace_aggregate = qemu_mallocz(mtrace_aggregate_size *
+				    sizeof(mtrace_aggregate[0]));
+    for (i = 0; i < n; i++)
+	if (old[i].host_addr)
+	    *mtrace_aggregate_slot(old[i].host_addr, old[i].cpu) = old[i];
+    qemu_free(old);
 }
 
-void mtrace_call_trace_set(int b)
+static void mtrace_aggregate_access(mtrace_access_t type,
+				    target_ulong host_addr,
+				    target_ulong guest_addr,
+				    void *retaddr)
 {
-    mtrace_call_trace = b;
+    uint64_t line = host_addr & ~((1ULL << mtrace_cline_shift) - 1);
+    uint16_t cpu = cpu_single_env->cpu_index;
+    struct mtrace_aggregate_line *l;
+
+    if ((mtrace_aggregate_count + 1) * 2 > mtrace_aggregate_size)
+	mtrace_aggregate_grow();
+    l = mtrace_aggregate_slot(line, cpu);
+    if (l->host_addr == 0) {
+	l->host_addr = line;
+	l->guest_addr = guest_addr;
+	l->pc = mtrace_get_pc((unsigned long)retaddr, NULL);
+	l->cpu = cpu;
+	mtrace_aggregate_count++;
+    }
+    if (type == mtrace_access_ld)
+	l->reads++;
+    else
+	l->writes++;
 }
 
-void mtrace_sample_set(int n)
+/* Log a summary of every line touched since aggregation started */
+static void mtrace_aggregate_flush(void)
 {
-    mtrace_sample = n;
+    struct mtrace_cline_entry entry;
+    struct mtrace_aggregate_line *l;
+    uint64_t i;
+
+    for (i = 0; i < mtrace_aggregate_size; i++) {
+	l = &mtrace_aggregate[i];
+	if (l->host_addr == 0)
+	    continue;
+	entry.h.type = mtrace_entry_cline;
+	entry.h.size = sizeof(entry);
+	entry.h.cpu = l->cpu;
+	entry.h.access_count = mtrace_access_count;
+	entry.h.ts = 0;
+	entry.host_addr = l->host_addr;
+	entry.guest_addr = l->guest_addr;
+	entry.pc = l->pc;
+	entry.reads = l->reads;
+	entry.writes = l->writes;
+	mtrace_log_entry((union mtrace_entry *)&entry);
+    }
+    qemu_free(mtrace_aggregate);
+    mtrace_aggregate = NULL;
+    mtrace_aggregate_size = 0;
+    mtrace_aggregate_count = 0;
 }
 
-int mtrace_enable_get(void)
+/*
+ * Sorted, disjoint [start, end) ranges, searched by bisection
+ */
+struct mtrace_range {
+    uint64_t start;
+    uint64_t end;
+};
+
+struct mtrace_ranges {
+    struct mtrace_range *r;
+    unsigned int n;
+    unsigned int size;
+};
+
+/* The first range that ends at or after addr */
+static unsigned int mtrace_ranges_find(struct mtrace_ranges *s, uint64_t addr)
 {
-    return mtrace_mode != 0;
+    unsigned int lo = 0, hi = s->n, mid;
+
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (s->r[mid].end < addr)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
 }
 
-void mtrace_quantum_set(int n)
+static int mtrace_ranges_match(struct mtrace_ranges *s, uint64_t addr)
 {
-    mtrace_quantum = n;
+    unsigned int i = mtrace_ranges_find(s, addr + 1);
+
+    return i < s->n && s->r[i].start <= addr;
 }
 
-int mtrace_quantum_get(void)
+/*
+ * Add [start, end).  With merge, it absorbs the ranges it overlaps or
+ * touches; otherwise it replaces the ones it overlaps.
+ */
+static void mtrace_ranges_add(struct mtrace_ranges *s, uint64_t start,
+			      uint64_t end, int merge)
 {
-    return mtrace_quantum;
+    unsigned int i = mtrace_ranges_find(s, merge ? start : start + 1);
+    unsigned int j = i;
+
+    while (j < s->n && (s->r[j].start < end ||
+			(merge && s->r[j].start == end))) {
+	if (merge) {
+	    start = MIN(start, s->r[j].start);
+	    end = MAX(end, s->r[j].end);
+	}
+	j++;
+    }
+
+    if (i == j) {
+	if (s->n == s->size) {
+	    s->size = s->size ? s->size * 2 : 64;
+	    s->r = qemu_realloc(s->r, s->size * sizeof(s->r[0]));
+	}
+	memmove(&s->r[i + 1], &s->r[i], (s->n - i) * sizeof(s->r[0]));
+	s->n++;
+    } else if (j > i + 1) {
+	memmove(&s->r[i + 1], &s->r[j], (s->n - j) * sizeof(s->r[0]));
+	s->n -= j - i - 1;
+    }
+    s->r[i].start = start;
+    s->r[i].end = end;
 }
 
-void mtrace_log_file_set(const char *path)
+/* Remove the range that starts at start, if any */
+static void mtrace_ranges_del(struct mtrace_ranges *s, uint64_t start)
 {
-    int outfd, p[2], check[2], child, r;
-    struct stat st;
+    unsigned int i = mtrace_ranges_find(s, start + 1);
 
-    outfd = open(path, O_CREAT|O_WRONLY|O_TRUNC, 0666);
-    if (outfd < 0) {
-        perror("mtrace: open");
-        abort();
-    }
-    if (fstat(outfd, &st) < 0) {
-	perror("mtrace: fstat");
-	abort();
-    }
-    if (S_ISFIFO(st.st_mode)) {
-	mtrace_file = outfd;
-	return;
+    if (i < s->n && s->r[i].start == start) {
+	memmove(&s->r[i], &s->r[i + 1], (s->n - i - 1) * sizeof(s->r[0]));
+	s->n--;
     }
+}
 
-    if (pipe(p) < 0 || pipe(check) < 0) {
-	perror("mtrace: pipe");
-	abort();
-    }
-    if (fcntl(check[1], F_SETFD,
-	      fcntl(check[1], F_GETFD, 0) | FD_CLOEXEC) < 0) {
-	perror("mtrace: fcntl");
-	abort();
+/*
+ * Access filter rules (see mtrace_filter_t).  Physical ranges are
+ * turned into host ranges, page by page, since that's what accesses
+ * carry.  Those from the command line wait in phys_pending for guest
+ * RAM to exist, until recording first starts.
+ */
+static struct {
+    int active;
+    struct mtrace_ranges virt;
+    struct mtrace_ranges host;
+    struct mtrace_ranges objects;	/* Labeled objects that matched */
+    uint32_t label_types;		/* Bit per mtrace_label_t */
+    char (*names)[64];
+    unsigned int nnames;
+    struct mtrace_ranges phys_pending;
+} mtrace_filter;
+
+static void mtrace_filter_add_phys(uint64_t start, uint64_t end)
+{
+    uint64_t addr, next;
+    unsigned long pd;
+    PhysPageDesc *p;
+    uint8_t *host;
+
+    for (addr = start; addr < end; addr = next) {
+	next = (addr & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
+	if (next > end || next == 0)
+	    next = end;
+	p = phys_page_find(addr >> TARGET_PAGE_BITS);
+	if (!p)
+	    continue;
+	pd = p->phys_offset;
+	if ((pd & ~TARGET_PAGE_MASK) > IO_MEM_ROM && !(pd & IO_MEM_ROMD))
+	    continue;
+	host = qemu_get_ram_ptr(pd & TARGET_PAGE_MASK) +
+	    (addr & ~TARGET_PAGE_MASK);
+	mtrace_ranges_add(&mtrace_filter.host, (uintptr_t)host,
+			  (uintptr_t)host + (next - addr), 1);
     }
+}
 
-    child = fork();
-    if (child < 0) {
-	perror("mtrace: fork");
-	abort();
-    } else if (child == 0) {
-	close(check[0]);
-	dup2(outfd, 1);
-	close(outfd);
-	dup2(p[0], 0);
-	close(p[0]);
-	close(p[1]);
-	r = execlp("gzip", "gzip", NULL);
-	r = write(check[1], &r, sizeof(r));
-	exit(0);
-    }
-    close(outfd);
-    close(p[0]);
-    close(check[1]);
-
-    if (read(check[0], &r, sizeof(r)) != 0) {
-	errno = r;
-	perror("mtrace: exec");
-	abort();
-    }
-    close(check[0]);
+static void mtrace_filter_add_pending(void)
+{
+    unsigned int i;
 
-    child_pid = child;
-    mtrace_file = p[1];
+    for (i = 0; i < mtrace_filter.phys_pending.n; i++)
+	mtrace_filter_add_phys(mtrace_filter.phys_pending.r[i].start,
+			       mtrace_filter.phys_pending.r[i].end);
+    mtrace_filter.phys_pending.n = 0;
 }
 
-static void write_all(int fd, const void *data, size_t len)
+static int mtrace_filter_add(mtrace_filter_t type, uint64_t start,
+			     uint64_t end, const char *str)
 {
-    while (len) {
-	ssize_t r = write(fd, data, len);
-	if (r < 0) {
-	    if (errno == EINTR)
-		continue;
-	    perror("write_all: write");
-	    abort();
-	}
-	len -= r;
-	data += r;
+    switch (type) {
+    case mtrace_filter_clear:
+	qemu_free(mtrace_filter.virt.r);
+	qemu_free(mtrace_filter.host.r);
+	qemu_free(mtrace_filter.objects.r);
+	qemu_free(mtrace_filter.names);
+	qemu_free(mtrace_filter.phys_pending.r);
+	memset(&mtrace_filter, 0, sizeof(mtrace_filter));
+	return 0;
+    case mtrace_filter_virt:
+	if (start >= end)
+	    return -1;
+	mtrace_ranges_add(&mtrace_filter.virt, start, end, 1);
+	break;
+    case mtrace_filter_phys:
+	if (start >= end)
+	    return -1;
+	mtrace_ranges_add(&mtrace_filter.phys_pending, start, end, 1);
+	break;
+    case mtrace_filter_label_type:
+	if (start == 0 || start >= mtrace_label_end)
+	    return -1;
+	mtrace_filter.label_types |= 1 << start;
+	break;
+    case mtrace_filter_label_name:
+	mtrace_filter.names = qemu_realloc(mtrace_filter.names,
+					   (mtrace_filter.nnames + 1) *
+					   sizeof(mtrace_filter.names[0]));
+	memset(mtrace_filter.names[mtrace_filter.nnames], 0,
+	       sizeof(mtrace_filter.names[0]));
+	strncpy(mtrace_filter.names[mtrace_filter.nnames], str,
+		sizeof(mtrace_filter.names[0]) - 1);
+	mtrace_filter.nnames++;
+	break;
+    default:
+	return -1;
     }
+    mtrace_filter.active = 1;
+    return 0;
 }
 
-static void mtrace_log_entry(union mtrace_entry *entry)
+/* Start or stop matching a labeled object */
+static void mtrace_filter_label(struct mtrace_label_entry *l)
 {
-    static uint8_t flush_buffer[FLUSH_BUFFER_BYTES];
-    static int n;
+    unsigned int i;
+    int match;
 
-    if (entry == NULL) {
-	write_all(mtrace_file, flush_buffer, n);
-	n = 0;
+    if (l->bytes == 0) {
+	mtrace_ranges_del(&mtrace_filter.objects, l->guest_addr);
 	return;
     }
 
-    if (n + entry->h.size > FLUSH_BUFFER_BYTES) {
-	write_all(mtrace_file, flush_buffer, n);
-	n = 0;
-    }
-    
-    if (entry->h.size > FLUSH_BUFFER_BYTES)
-	write_all(mtrace_file, entry, entry->h.size);
-    else {
-	memcpy(&flush_buffer[n], entry, entry->h.size);
-	n += entry->h.size;
-    }
+    match = l->label_type < mtrace_label_end &&
+	(mtrace_filter.label_types & (1 << l->label_type));
+    for (i = 0; i < mtrace_filter.nnames && !match; i++)
+	match = !strncmp(mtrace_filter.names[i], l->str, sizeof(l->str));
+    if (match)
+	mtrace_ranges_add(&mtrace_filter.objects, l->guest_addr,
+			  l->guest_addr + l->bytes, 0);
 }
 
-static struct mtrace_call_stack_info *mtrace_get_per_call_stack(uint64_t tag)
+static int mtrace_filter_match(target_ulong host_addr,
+			       target_ulong guest_addr)
 {
-    const int buckets = sizeof(mtrace_per_call_stack) / sizeof(mtrace_per_call_stack[0]);
-    int i;
-    for (i = 0; i < buckets; i++) {
-	unsigned bucket = (tag + i) % buckets;
-	struct mtrace_call_stack_info *cs = &mtrace_per_call_stack[bucket];
-	if (cs->tag == tag) {
-	    return cs;
-	} else if (cs->tag == 0) {
-	    *cs = (struct mtrace_call_stack_info){.tag = tag};
-	    return cs;
-	}
-    }
-    fprintf(stderr, "mtrace_per_call_stack hash table full\n");
-    abort();
+    return mtrace_ranges_match(&mtrace_filter.virt, guest_addr) ||
+	mtrace_ranges_match(&mtrace_filter.objects, guest_addr) ||
+	mtrace_ranges_match(&mtrace_filter.host, host_addr);
 }
 
-static void mtrace_del_per_call_stack(uint64_t tag)
+/*
+ * Parse -mtrace-filter rules, a comma-separated list of virt=start-end,
+ * phys=start-end, type=heap|block|static|percpu and label=name
+ */
+int mtrace_filter_parse(const char *spec)
 {
-    const int buckets = sizeof(mtrace_per_call_stack) / sizeof(mtrace_per_call_stack[0]);
-    struct mtrace_call_stack_info *found = NULL, *last = NULL;
-    int i;
-    for (i = 0; i < buckets; i++) {
-	unsigned bucket = (tag + i) % buckets;
-	last = &mtrace_per_call_stack[bucket];
-	if (last->tag == tag) {
-	    found = last;
-	} else if (last->tag == 0) {
+    static const char *types[] = {
+	[mtrace_label_heap] = "heap",
+	[mtrace_label_block] = "block",
+	[mtrace_label_static] = "static",
+	[mtrace_label_percpu] = "percpu",
+    };
+    char *buf = qemu_strdup(spec);
+    char *rule, *save, *val, *end;
+    uint64_t start, stop;
+    int r = 0, t;
+
+    for (rule = strtok_r(buf, ",", &save); rule && !r;
+	 rule = strtok_r(NULL, ",", &save)) {
+	val = strchr(rule, '=');
+	if (!val) {
+	    r = -1;
 	    break;
 	}
+	*val++ = 0;
+	if (!strcmp(rule, "virt") || !strcmp(rule, "phys")) {
+	    start = strtoull(val, &end, 0);
+	    if (*end != '-') {
+		r = -1;
+		break;
+	    }
+	    stop = strtoull(end + 1, &end, 0);
+	    if (*end) {
+		r = -1;
+		break;
+	    }
+	    r = mtrace_filter_add(rule[0] == 'v' ? mtrace_filter_virt :
+				  mtrace_filter_phys, start, stop, NULL);
+	} else if (!strcmp(rule, "type")) {
+	    for (t = 1; t < mtrace_label_end; t++)
+		if (!strcmp(val, types[t]))
+		    break;
+	    r = mtrace_filter_add(mtrace_filter_label_type, t, 0, NULL);
+	} else if (!strcmp(rule, "label") && *val) {
+	    r = mtrace_filter_add(mtrace_filter_label_name, 0, 0, val);
+	} else {
+	    r = -1;
+	}
     }
-    if (found == last || found == NULL)
-	return;
-    *found = *last;
-    last->tag = 0;
+    qemu_free(buf);
+    return r;
 }
 
-static struct mtrace_call_stack_info *mtrace_my_call_stack(int cpu)
-{
-    if (!mtrace_call_stack_tagvalid[cpu])
-	return 0;
-    return mtrace_get_per_call_stack(mtrace_call_stack[cpu]);
-}
+/*
+ * Sampling state per CPU, so CPUs don't thin out each other's accesses
+ * and the decision never needs the pc
+ */
+struct mtrace_sampler {
+    uint64_t count;		/* mtrace_sample_count */
+    uint64_t skip;		/* mtrace_sample_random: accesses left to drop */
+    uint64_t rng;
+};
 
-#if 0
-static unsigned long mtrace_get_pc(unsigned long searched_pc)
+static struct mtrace_sampler mtrace_sampler[255];
+
+/* xorshift64*, seeded per CPU so runs are repeatable */
+static uint64_t mtrace_sample_rand(struct mtrace_sampler *s, int cpu)
 {
-    return cpu_single_env->eip;
+    if (s->rng == 0)
+	s->rng = 0x9e3779b97f4a7c15ULL * (cpu + 1);
+    s->rng ^= s->rng >> 12;
+    s->rng ^= s->rng << 25;
+    s->rng ^= s->rng >> 27;
+    return s->rng * 0x2545f4914f6cdd1dULL;
 }
-#endif
 
-static unsigned long mtrace_get_pc(unsigned long searched_pc)
+/*
+ * Whether to log cpu's access to host_addr.  Geometric gaps with mean
+ * mtrace_sample - 1 make every access equally likely to be logged
+ * without the aliasing a fixed stride has with loops.  Line sampling
+ * logs every access to the lines it picks and none to the others, so
+ * movement between the CPUs that share a line stays visible.
+ */
+static int mtrace_sample_keep(CPUX86State *env, target_ulong host_addr)
 {
-    mtrace_record_mode_t mtrace_mode_save;
-    TranslationBlock *tb;
-
-    /*
-     * If searched_pc is NULL, or we can't find a TB, then cpu_single_env->eip 
-     * is (hopefully, probably?) up-to-date.  This happens, for example, when
-     * generating micro ops.
-     */
-    if (searched_pc == 0)
-	return cpu_single_env->eip;
-
-    /*
-     * This is pretty heavy weight.  It doesn't look like QEMU saves the 
-     * mappings required to translated a TCG code PC into a guest PC.  So, we:
-     *
-     *  1. find the TB for the TCG code PC (searched_pc)
-     *  Call cpu_restore_state, which:
-     *  2. generates the micro ops
-     *  3. finds the offset of the micro op that corresponds to searched_pc's 
-     *     offset in the TCG code of the TB
-     *  4. uses gen_opc_pc to convert the offset of the micro op into a guest 
-     *     PC
-     *  5. updates cpu_single_env->eip
-     *
-     *  NB QEMU reads guest memory while generating micro ops.  We want to
-     *  ignore these accesses, so we temporarily set mtrace_mode to 0.
-     */
-    tb = tb_find_pc(searched_pc);
-    if (!tb)
-	return cpu_single_env->eip;
+    struct mtrace_sampler *s = &mtrace_sampler[env->cpu_index];
+    uint64_t h;
+    double u;
 
-    mtrace_mode_save = mtrace_mode;
-    mtrace_mode = 0;
-    cpu_restore_state(tb, cpu_single_env, searched_pc, NULL);
-    mtrace_mode = mtrace_mode_save;
+    if (mtrace_sample == 1)
+	return 1;
 
-    return cpu_single_env->eip;
+    switch (mtrace_sample_mode) {
+    case mtrace_sample_random:
+	if (s->skip) {
+	    s->skip--;
+	    return 0;
+	}
+	/* u in (0, 1] */
+	u = ((mtrace_sample_rand(s, env->cpu_index) >> 11) + 1) /
+	    9007199254740992.0;
+	s->skip = floor(log(u) / log(1.0 - 1.0 / mtrace_sample));
+	return 1;
+    case mtrace_sample_line:
+	h = (host_addr >> mtrace_cline_shift) * 0x9e3779b97f4a7c15ULL;
+	return (h >> 32) % mtrace_sample == 0;
+    case mtrace_sample_burst:
+	return (mtrace_get_percore_tsc(env) / mtrace_sample_insns) %
+	    mtrace_sample == 0;
+    default:
+	return s->count++ % mtrace_sample == 0;
+    }
 }
 
 static void mtrace_access_dump(mtrace_access_t type, target_ulong host_addr, 
@@ -321,29 +2059,255 @@ static void mtrace_access_dump(mtrace_access_t type, target_ulong host_addr,
                                char bytes)
 {
     struct mtrace_access_entry entry;
-    static int sampler;
+    uint64_t ts;
     
     if (!mtrace_mode)
 	return;
-    if (sampler++ % mtrace_sample)
+    /* Before anything that costs, like finding the pc */
+    if (mtrace_filter.active && !mtrace_filter_match(host_addr, guest_addr)) {
+	mtrace_cpu_stats[cpu_single_env->cpu_index].filter_drops++;
+	return;
+    }
+    if (mtrace_mode == mtrace_record_aggregate) {
+	mtrace_aggregate_access(type, host_addr, guest_addr, retaddr);
+	return;
+    }
+    if (!mtrace_sample_keep(cpu_single_env, host_addr)) {
+	mtrace_cpu_stats[cpu_single_env->cpu_index].sample_drops++;
 	return;
+    }
 
     entry.h.type = mtrace_entry_access;
     entry.h.size = sizeof(entry);
     entry.h.cpu = cpu_single_env->cpu_index;
     entry.h.access_count = access_count;
-    entry.h.ts = 0; /* Unimplemented timestamp */
     entry.access_type = type;
-    entry.pc = mtrace_get_pc((unsigned long)retaddr);
+    entry.pc = mtrace_get_pc((unsigned long)retaddr, &ts);
+    /* Older formats can only compact accesses without a ts */
+    entry.h.ts = mtrace_format >= MTRACE_FORMAT_V5 ? ts : 0;
     entry.host_addr = host_addr;
     entry.guest_addr = guest_addr;
     entry.traffic = traffic;
     entry.lock = lock;
+    entry.deps = 0;
     entry.bytes = bytes;
+    entry.cache = mtrace_cache_none;
+    entry.cache_cpu = 0;
+    if (mtrace_cache_active()) {
+	entry.cache = mtrace_cache_last[entry.h.cpu].result;
+	entry.cache_cpu = mtrace_cache_last[entry.h.cpu].cpu;
+    }
+    entry.stack_id = 0;
+    if (mtrace_call_trace && mtrace_format >= MTRACE_FORMAT_V4) {
+	struct mtrace_call_stack_info *s =
+	    mtrace_my_call_stack(entry.h.cpu);
+	if (s)
+	    entry.stack_id = s->stack_id;
+    }
 
     mtrace_log_entry((union mtrace_entry *)&entry);
 }
 
+/*
+ * With more than 8 CPUs, a bit per CPU doesn't fit in cline_track.
+ * Instead, cline_track holds the cpu_index of the CPU with the only
+ * copy of the line, or MTRACE_CLINE_SHARED.  The sharers of a shared
+ * line live in a bitmap that is allocated the first time a line on
+ * that page goes from one owner to several.  Until then, a shared line
+ * is shared by every CPU, which is what mtrace_reset_cline_track
+ * starts from.
+ */
+#define MTRACE_CLINE_SHARED	0xff
+/* An owner no CPU has, for mtrace_cline_none */
+#define MTRACE_CLINE_UNTRACKED	0xfe
+
+mtrace_cline_encoding_t mtrace_cline_encoding_get(void)
+{
+    return mtrace_cline_encoding;
+}
+
+static int mtrace_cline_owner_ld(RAMBlock *block, unsigned long cline,
+				 unsigned int cpu)
+{
+    uint8_t **page = &block->cline_sharers[cline / MTRACE_CLINES_PER_PAGE];
+    uint8_t owner = block->cline_track[cline];
+    uint8_t *sharers;
+
+    if (owner == cpu)
+	return 0;
+
+    if (owner == MTRACE_CLINE_SHARED) {
+	if (!*page)
+	    return 0;
+	sharers = *page + (cline % MTRACE_CLINES_PER_PAGE) *
+	    mtrace_cline_sharer_bytes;
+	if (sharers[cpu / 8] & (1 << (cpu % 8)))
+	    return 0;
+	sharers[cpu / 8] |= 1 << (cpu % 8);
+	return 1;
+    }
+
+    if (!*page) {
+	/* Other shared lines on this page are still shared by everyone */
+	*page = qemu_malloc(MTRACE_CLINES_PER_PAGE *
+			    mtrace_cline_sharer_bytes);
+	memset(*page, 0xff, MTRACE_CLINES_PER_PAGE *
+	       mtrace_cline_sharer_bytes);
+    }
+    sharers = *page + (cline % MTRACE_CLINES_PER_PAGE) *
+	mtrace_cline_sharer_bytes;
+    memset(sharers, 0, mtrace_cline_sharer_bytes);
+    sharers[owner / 8] |= 1 << (owner % 8);
+    sharers[cpu / 8] |= 1 << (cpu % 8);
+    block->cline_track[cline] = MTRACE_CLINE_SHARED;
+    return 1;
+}
+
+static void mtrace_cline_sharers_free(RAMBlock *block)
+{
+    ram_addr_t i;
+
+    if (!block->cline_sharers)
+	return;
+    for (i = 0; i < block->length >> TARGET_PAGE_BITS; i++)
+	qemu_free(block->cline_sharers[i]);
+    qemu_free(block->cline_sharers);
+    block->cline_sharers = NULL;
+}
+
+/* Start every CPU's cache out empty */
+static void mtrace_cache_reset(void)
+{
+    size_t size = mtrace_cache_sets * mtrace_cache_ways *
+	sizeof(struct mtrace_cache_way);
+    int cpu;
+
+    for (cpu = 0; cpu < smp_cpus; cpu++) {
+	if (!mtrace_cache[cpu])
+	    mtrace_cache[cpu] = qemu_vmalloc(size);
+	memset(mtrace_cache[cpu], 0, size);
+    }
+    mtrace_cache_clock = 0;
+}
+
+static struct mtrace_cache_way *mtrace_cache_set_get(unsigned int cpu,
+						     uint64_t line)
+{
+    return &mtrace_cache[cpu][(line & (mtrace_cache_sets - 1)) *
+			      mtrace_cache_ways];
+}
+
+/* The way in cpu's cache that holds or was stolen line, or NULL */
+static struct mtrace_cache_way *mtrace_cache_lookup(unsigned int cpu,
+						    uint64_t line)
+{
+    struct mtrace_cache_way *set = mtrace_cache_set_get(cpu, line);
+    int i;
+
+    for (i = 0; i < mtrace_cache_ways; i++)
+	if (set[i].line == line &&
+	    (set[i].state != mtrace_mesi_invalid || set[i].stolen))
+	    return &set[i];
+    return NULL;
+}
+
+/*
+ * An empty way if there is one, then the least recently stolen way,
+ * then the least recently used.  Evicting a modified line would write
+ * it back, but that's invisible to the other CPUs.
+ */
+static struct mtrace_cache_way *mtrace_cache_victim(unsigned int cpu,
+						    uint64_t line)
+{
+    struct mtrace_cache_way *set = mtrace_cache_set_get(cpu, line);
+    struct mtrace_cache_way *v = &set[0];
+    int i, valid, vvalid;
+
+    for (i = 0; i < mtrace_cache_ways; i++) {
+	if (set[i].state == mtrace_mesi_invalid && !set[i].stolen)
+	    return &set[i];
+	valid = set[i].state != mtrace_mesi_invalid;
+	vvalid = v->state != mtrace_mesi_invalid;
+	if (valid < vvalid || (valid == vvalid && set[i].used < v->used))
+	    v = &set[i];
+    }
+    return v;
+}
+
+/*
+ * Run an access through cpu's cache and fix up the other caches.  A
+ * load takes a modified line from its owner; a store, including one to
+ * a shared line it holds, invalidates every other copy.  Either counts
+ * as a coherence miss, as does an access to a line another CPU stole.
+ * Returns 1 unless the access hit.
+ */
+static int mtrace_cache_access(uint8_t *host_addr, unsigned int cpu,
+			       int store)
+{
+    uint64_t line = (uintptr_t)host_addr >> mtrace_cline_shift;
+    struct mtrace_cache_way *w = mtrace_cache_lookup(cpu, line);
+    struct mtrace_cache_way *o;
+    mtrace_cache_t result = mtrace_cache_miss;
+    int source = -1, holder = -1, shared = 0;
+    int i;
+
+    if (w && w->state != mtrace_mesi_invalid) {
+	w->used = ++mtrace_cache_clock;
+	if (!store || w->state != mtrace_mesi_shared) {
+	    if (store)
+		w->state = mtrace_mesi_modified;
+	    mtrace_cpu_stats[cpu].cache[mtrace_cache_hit]++;
+	    mtrace_cache_last[cpu].result = mtrace_cache_hit;
+	    mtrace_cache_last[cpu].cpu = 0;
+	    return 0;
+	}
+	/* An upgrade, which is free if nobody else kept a copy */
+	result = mtrace_cache_hit;
+    } else if (w) {
+	result = mtrace_cache_coherence;
+	source = w->thief;
+    }
+
+    for (i = 0; i < smp_cpus; i++) {
+	if (i == cpu || !(o = mtrace_cache_lookup(i, line)) ||
+	    o->state == mtrace_mesi_invalid)
+	    continue;
+	if (store) {
+	    if (holder < 0 || o->state == mtrace_mesi_modified)
+		holder = i;
+	    o->state = mtrace_mesi_invalid;
+	    o->stolen = 1;
+	    o->thief = cpu;
+	} else {
+	    if (o->state == mtrace_mesi_modified)
+		holder = i;
+	    o->state = mtrace_mesi_shared;
+	    shared = 1;
+	}
+    }
+    if (holder >= 0) {
+	result = mtrace_cache_coherence;
+	source = holder;
+    }
+
+    if (!w || w->state == mtrace_mesi_invalid) {
+	if (!w)
+	    w = mtrace_cache_victim(cpu, line);
+	w->line = line;
+    }
+    if (store)
+	w->state = mtrace_mesi_modified;
+    else
+	w->state = shared ? mtrace_mesi_shared : mtrace_mesi_exclusive;
+    w->stolen = 0;
+    w->used = ++mtrace_cache_clock;
+
+    mtrace_cpu_stats[cpu].cache[result]++;
+    mtrace_cache_last[cpu].result = result;
+    mtrace_cache_last[cpu].cpu = source < 0 ? 0 : source;
+    return result != mtrace_cache_hit;
+}
+
 static int mtrace_cline_update_ld(uint8_t * host_addr, unsigned int cpu)
 {
     unsigned long offset;
@@ -358,16 +2322,22 @@ static int mtrace_cline_update_ld(uint8_t * host_addr, unsigned int cpu)
     if (mtrace_mode == mtrace_record_ascope ||
 	mtrace_mode == mtrace_record_kernelscope)
     {
-	/* Abstract scope mode.  Everything gets tracked.  We rely on
-	 * higher-level filtering in mtrace_access_enabled, so we only
-	 * get here if this access is performed by code running in an
-	 * ascope.  We could filter to unique accesses only (we used
-	 * to), but we'd have to track this per-ascope (or at least
-	 * per-CPU) since multiple ascopes can be running in
-	 * parallel. */
+	/* Abstract scope mode.  We rely on higher-level filtering in
+	 * mtrace_access_enabled, so we only get here if this access is
+	 * performed by code running in an ascope.  Multiple ascopes
+	 * can be running in parallel, so unique accesses are tracked
+	 * per call stack. */
+	return mtrace_ascope_update(host_addr, cpu, 0);
+    } else if (mtrace_mode == mtrace_record_aggregate) {
 	return 1;
+    } else if (mtrace_cache_ways) {
+	return mtrace_cache_access(host_addr, cpu, 0);
     } else {
-        unsigned long cline = offset >> MTRACE_CLINE_SHIFT;
+        unsigned long cline = offset >> mtrace_cline_shift;
+
+	mtrace_cline_page_refresh(block, offset);
+	if (mtrace_cline_encoding == mtrace_cline_owner)
+	    return mtrace_cline_owner_ld(block, cline, cpu);
 
 	/* Movement mode.  Each bit records a CPU. */
 	if (block->cline_track[cline] & (1 << cpu))
@@ -392,9 +2362,21 @@ static int mtrace_cline_update_st(uint8_t *host_addr, unsigned int cpu)
     if (mtrace_mode == mtrace_record_ascope ||
 	mtrace_mode == mtrace_record_kernelscope)
     {
+	return mtrace_ascope_update(host_addr, cpu, 1);
+    } else if (mtrace_mode == mtrace_record_aggregate) {
 	return 1;
+    } else if (mtrace_cache_ways) {
+	return mtrace_cache_access(host_addr, cpu, 1);
     } else {
-	unsigned long cline = offset >> MTRACE_CLINE_SHIFT;
+	unsigned long cline = offset >> mtrace_cline_shift;
+
+	mtrace_cline_page_refresh(block, offset);
+	if (mtrace_cline_encoding == mtrace_cline_owner) {
+	    if (block->cline_track[cline] == cpu)
+		return 0;
+	    block->cline_track[cline] = cpu;
+	    return 1;
+	}
 
 	/* Movement mode. */
 	if (block->cline_track[cline] == (1 << cpu))
@@ -409,6 +2391,10 @@ static inline int mtrace_access_enabled(void)
 {
     if (!mtrace_system_enable || !mtrace_mode)
 	return 0;
+    /* Ring entries may change the ascope depth, and any CPU's may
+     * label what this access touches */
+    if (mtrace_guest_nrings)
+	mtrace_guest_ring_drain_all(mtrace_access_count);
     if (mtrace_mode == mtrace_record_ascope) {
 	struct mtrace_call_stack_info *s =
 	    mtrace_my_call_stack(cpu_single_env->cpu_index);
@@ -510,22 +2496,30 @@ void mtrace_io_read(void *cb, target_phys_addr_t ram_addr,
     /* Nothing to do.. */
 }
 
-static inline uint64_t mtrace_get_percore_tsc(CPUX86State *env)
-{
-    return mtrace_inst_count[env->cpu_index];
-}
-
 static inline uint64_t mtrace_get_global_tsc(CPUX86State *env)
 {
     uint64_t t;
-    int i;
 
     t = 0;
-    for (i = 0; i < smp_cpus; i++)
-	t += mtrace_inst_count[i];
+    for (env = first_cpu; env != NULL; env = env->next_cpu)
+	t += mtrace_get_percore_tsc(env);
     return t;
 }
 
+static void mtrace_count_disable_set(CPUX86State *env, int b)
+{
+    int cpu = env->cpu_index;
+
+    if (mtrace_count_disable[cpu] == b)
+	return;
+    if (b)
+	mtrace_count_disable_start[cpu] = env->mtrace_insn_count;
+    else
+	mtrace_count_skip[cpu] += env->mtrace_insn_count -
+	    mtrace_count_disable_start[cpu];
+    mtrace_count_disable[cpu] = b;
+}
+
 void mtrace_lock_start(CPUX86State *env)
 {
     if (!mtrace_lock_trace)
@@ -545,6 +2539,7 @@ void mtrace_lock_start(CPUX86State *env)
 #endif
     }
     mtrace_lock_active[env->cpu_index] = 1;
+    mtrace_cline_mask_update(env);
 }
 
 void mtrace_lock_stop(CPUX86State *env)
@@ -557,9 +2552,29 @@ void mtrace_lock_stop(CPUX86State *env)
 	abort();
     }
     mtrace_lock_active[env->cpu_index] = 0;
+    mtrace_cline_mask_update(env);
+}
+
+/*
+ * Translate guest_addr through env's softmmu TLB, which almost always
+ * has the page the guest just wrote an entry to.  Returns NULL on a
+ * miss or for I/O pages.
+ */
+static void *mtrace_tlb_host_addr(CPUX86State *env, target_ulong guest_addr)
+{
+    int index = (guest_addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    CPUTLBEntry *tlb = &env->tlb_table[cpu_mmu_index(env)][index];
+
+    if ((guest_addr & TARGET_PAGE_MASK) !=
+	(tlb->addr_read & (TARGET_PAGE_MASK | TLB_INVALID_MASK)))
+	return NULL;
+    if (tlb->addr_read & ~TARGET_PAGE_MASK)
+	return NULL;
+    return (void *)(uintptr_t)(guest_addr + tlb->addend);
 }
 
-static int mtrace_host_addr(target_ulong guest_addr, target_ulong *host_addr)
+static int mtrace_host_addr(CPUX86State *env, target_ulong guest_addr,
+			    target_ulong *host_addr)
 {
     target_phys_addr_t phys;
     target_phys_addr_t page;
@@ -567,7 +2582,14 @@ static int mtrace_host_addr(target_ulong guest_addr, target_ulong *host_addr)
     PhysPageDesc *p;
     void *ptr;
 
-    phys = cpu_get_phys_page_debug(cpu_single_env, guest_addr);
+    ptr = mtrace_tlb_host_addr(env, guest_addr);
+    if (ptr) {
+	*host_addr = (target_ulong)(uintptr_t)ptr;
+	return 0;
+    }
+
+    /* Otherwise walk the page tables */
+    phys = cpu_get_phys_page_debug(env, guest_addr);
     if (phys == -1)
 	return -1;
     phys += (guest_addr & ~TARGET_PAGE_MASK);
@@ -591,20 +2613,45 @@ static int mtrace_host_addr(target_ulong guest_addr, target_ulong *host_addr)
     return 0;
 }
 
+/*
+ * Start movement tracking over with every line shared by every CPU.
+ * Rather than touching all of RAM, this bumps the epoch and lets
+ * mtrace_cline_page_refresh reset each page the first time it's used.
+ * Switching into movement mode always refills the mtrace_cline_tlb
+ * entries (see mtrace_instrument_set), so none still point at a page
+ * with stale lines.
+ */
 static void mtrace_reset_cline_track(mtrace_record_mode_t mode)
 {
     RAMBlock *block;
 
-    if (mode == mtrace_record_ascope || mode == mtrace_record_kernelscope)
+    if (mode == mtrace_record_ascope || mode == mtrace_record_kernelscope ||
+	mode == mtrace_record_aggregate)
 	/* No tracking */
 	return;
 
+    if (mtrace_cache_ways) {
+	mtrace_cache_reset();
+	return;
+    }
+
+    /* A bit per CPU if that fits in a byte, otherwise an owner id */
+    if (smp_cpus <= 8) {
+	mtrace_cline_encoding = mtrace_cline_bitmap;
+	memset(mtrace_cline_none, 0, sizeof(mtrace_cline_none));
+    } else {
+	mtrace_cline_encoding = mtrace_cline_owner;
+	mtrace_cline_sharer_bytes = (smp_cpus + 7) / 8;
+	memset(mtrace_cline_none, MTRACE_CLINE_UNTRACKED,
+	       sizeof(mtrace_cline_none));
+    }
+
     QLIST_FOREACH(block, &ram_list.blocks, next) {
         ram_addr_t size;
         switch (mode) {
         case mtrace_record_movement:
             // One byte per cache line
-            size = block->length >> MTRACE_CLINE_SHIFT;
+            size = block->length >> mtrace_cline_shift;
             break;
         default:
             fprintf(stderr, "bad record mode %d\n", mode);
@@ -622,102 +2669,137 @@ static void mtrace_reset_cline_track(mtrace_record_mode_t mode)
             }
             /*
              * Could use qemu_madvise(MADV_MERGEABLE) if
-             * size >> MTRACE_CLINE_SHIFT is large
+             * size >> mtrace_cline_shift is large
              */
             block->cline_track_size = size;
+            /* Epoch 0 is always stale */
+            block->cline_epoch =
+                qemu_mallocz((block->length >> TARGET_PAGE_BITS) *
+                             sizeof(block->cline_epoch[0]));
         }
-        memset(block->cline_track, 0xff, size);
+
+        if (mtrace_cline_encoding == mtrace_cline_owner &&
+            !block->cline_sharers)
+            block->cline_sharers =
+                qemu_mallocz((block->length >> TARGET_PAGE_BITS) *
+                             sizeof(block->cline_sharers[0]));
+    }
+
+    if (++mtrace_cline_epoch == 0) {
+        /* Wrapped, so make every page stale again */
+        QLIST_FOREACH(block, &ram_list.blocks, next)
+            if (block->cline_epoch)
+                memset(block->cline_epoch, 0,
+                       (block->length >> TARGET_PAGE_BITS) *
+                       sizeof(block->cline_epoch[0]));
+        mtrace_cline_epoch = 1;
     }
 }
 
 /*
- * Handler for the mtrace magic instruction
+ * Log an entry from env's guest, either registered directly or taken
+ * from a guest ring
  */
-static void mtrace_entry_register(target_ulong entry_addr, target_ulong type,
-                                  target_ulong len, target_ulong n4,
-                                  target_ulong n5)
+static void mtrace_entry_process(CPUX86State *env, union mtrace_entry *entry,
+				 unsigned long type, unsigned long len,
+				 uint64_t access_count)
 {
-    union mtrace_entry entry;
     int r;
 
-    if (len > sizeof(entry)) {
-	fprintf(stderr, "mtrace_entry_register: entry too big: %lu > %u\n",
-		(unsigned long)len, (unsigned)sizeof(entry));
-	return;
-    }
-
-    /* (Could skip copying the header) */
-    r = cpu_memory_rw_debug(cpu_single_env, entry_addr, (uint8_t *)&entry, len, 0);
-    if (r) {
-	fprintf(stderr, "mtrace_entry_register: cpu_memory_rw_debug failed\n");
-	return;
-    }
-
-    entry.h.type = type;
-    entry.h.size = len;
-    entry.h.cpu = cpu_single_env->cpu_index;
-    entry.h.access_count = mtrace_access_count;
-    entry.h.ts = mtrace_get_percore_tsc(cpu_single_env);
+    entry->h.type = type;
+    entry->h.size = len;
+    entry->h.cpu = env->cpu_index;
+    entry->h.access_count = access_count;
+    entry->h.ts = mtrace_get_percore_tsc(env);
 
     /* Special handling */
     if (type == mtrace_entry_label) {
+	if (mtrace_filter.active)
+	    mtrace_filter_label(&entry->label);
 	/*
 	 * XXX bug -- guest_addr might cross multiple host memory allocations,
 	 * which means the [host_addr, host_addr + bytes] is not contiguous.
 	 *
 	 * A simple solution is probably to log multiple mtrace_label_entrys.
 	 */
-	r = mtrace_host_addr(entry.label.guest_addr, &entry.label.host_addr);
+	r = mtrace_host_addr(env, entry->label.guest_addr,
+			     &entry->label.host_addr);
 	if (r) {
 	    fprintf(stderr, "mtrace_entry_register: mtrace_host_addr failed (%"PRIx64")\n", 
-		    entry.label.guest_addr);
+		    entry->label.guest_addr);
 	    return;
 	}
     }
 
     /* Special handling */
     if (type == mtrace_entry_host) {
-	entry.host.global_ts = mtrace_get_global_tsc(cpu_single_env);
-	switch (entry.host.host_type) {
+	entry->host.global_ts = mtrace_get_global_tsc(env);
+	switch (entry->host.host_type) {
 	case mtrace_access_all_cpu:
-	    if (entry.host.access.mode && entry.host.access.mode != mtrace_mode)
-		mtrace_reset_cline_track(entry.host.access.mode);
-	    mtrace_mode = entry.host.access.mode;
+	    if (mtrace_mode == mtrace_record_aggregate &&
+		entry->host.access.mode != mtrace_mode)
+		mtrace_aggregate_flush();
+	    if (entry->host.access.mode && entry->host.access.mode != mtrace_mode)
+		mtrace_reset_cline_track(entry->host.access.mode);
+	    mtrace_ascope_seen_reset_all();
+	    if (mtrace_filter.phys_pending.n)
+		mtrace_filter_add_pending();
+	    mtrace_mode = entry->host.access.mode;
+	    mtrace_instrument_set(mtrace_instrument_mode(mtrace_mode));
 	    break;
 	case mtrace_call_clear_cpu:
-            if (entry.host.call.cpu == ~0UL)
-                mtrace_call_stack_active[cpu_single_env->cpu_index] = 0;
+            if (entry->host.call.cpu == ~0UL)
+                mtrace_call_stack_active[env->cpu_index] = 0;
             else
-                mtrace_call_stack_active[entry.host.call.cpu] = 0;
+                mtrace_call_stack_active[entry->host.call.cpu] = 0;
 	    break;
 	case mtrace_call_set_cpu:
 	    /* Only enable call traces when mtrace_enable */
-            if (entry.host.call.cpu == ~0UL)
-                mtrace_call_stack_active[cpu_single_env->cpu_index] = mtrace_mode;
+            if (entry->host.call.cpu == ~0UL)
+                mtrace_call_stack_active[env->cpu_index] = mtrace_mode;
             else
-                mtrace_call_stack_active[entry.host.call.cpu] = mtrace_mode;
+                mtrace_call_stack_active[entry->host.call.cpu] = mtrace_mode;
 	    break;
         case mtrace_disable_count_cpu:
-            mtrace_count_disable[cpu_single_env->cpu_index] = 1;
+            mtrace_count_disable_set(env, 1);
             /* No point in logging this */
             return;
         case mtrace_enable_count_cpu:
-            mtrace_count_disable[cpu_single_env->cpu_index] = 0;
+            mtrace_count_disable_set(env, 0);
             /* No point in logging this */
             return;
+	case mtrace_filter_all_cpu: {
+	    uint64_t start = entry->host.filter.start;
+
+	    if (entry->host.filter.type == mtrace_filter_label_type)
+		start = entry->host.filter.label_type;
+	    else if (entry->host.filter.type == mtrace_filter_label_name)
+		entry->host.filter.str[sizeof(entry->host.filter.str) - 1] = 0;
+	    if (mtrace_filter_add(entry->host.filter.type, start,
+				  entry->host.filter.end,
+				  entry->host.filter.str) < 0) {
+		fprintf(stderr, "mtrace_entry_register: bad filter rule %u\n",
+			entry->host.filter.type);
+		return;
+	    }
+	    mtrace_filter_add_pending();
+	    break;
+	}
 	default:
 	    fprintf(stderr, "bad mtrace_entry_host type %u\n", 
-		    entry.host.host_type);
+		    entry->host.host_type);
 	    abort();
 	}
     } 
 
     /* Track call stacks for filtering purposes */
     if (type == mtrace_entry_fcall) {
-	int cpu = entry.h.cpu;
-	uint64_t tag = entry.fcall.tag;
-	switch (entry.fcall.state) {
+	int cpu = entry->h.cpu;
+	uint64_t tag = entry->fcall.tag;
+	switch (entry->fcall.state) {
 	case mtrace_start:
+	    mtrace_get_per_call_stack(tag)->stack_id = 0;
+	    /* Fall through */
 	case mtrace_resume:
 	    mtrace_call_stack[cpu] = tag;
 	    mtrace_call_stack_tagvalid[cpu] = 1;
@@ -734,25 +2816,220 @@ static void mtrace_entry_register(target_ulong entry_addr, target_ulong type,
     /* Special handling for abstract scopes */
     if (type == mtrace_entry_ascope) {
 	struct mtrace_call_stack_info *s =
-	    mtrace_my_call_stack(entry.h.cpu);
+	    mtrace_my_call_stack(entry->h.cpu);
 	if (!s) {
 	    fprintf(stderr, "Error: mtrace_entry_ascope (%s, %s) with no stack tag!\n",
-                    entry.ascope.exit ? "exit" : "enter", entry.ascope.name);
+                    entry->ascope.exit ? "exit" : "enter", entry->ascope.name);
 	} else {
-	    if (entry.ascope.exit)
+	    if (entry->ascope.exit)
 		s->ascope_depth--;
 	    else
 		s->ascope_depth++;
+	    mtrace_ascope_seen_reset(s);
+	}
+    }
+
+    mtrace_log_entry(entry);
+}
+
+/*
+ * Handler for the mtrace magic instruction
+ */
+static void mtrace_entry_register(target_ulong entry_addr, target_ulong type,
+                                  target_ulong len, target_ulong n4,
+                                  target_ulong n5)
+{
+    union mtrace_entry entry;
+    void *ptr = NULL;
+    int r;
+
+    if (len > sizeof(entry)) {
+	fprintf(stderr, "mtrace_entry_register: entry too big: %lu > %u\n",
+		(unsigned long)len, (unsigned)sizeof(entry));
+	return;
+    }
+
+    /* (Could skip copying the header) */
+    if ((entry_addr & ~TARGET_PAGE_MASK) + len <= TARGET_PAGE_SIZE)
+	ptr = mtrace_tlb_host_addr(cpu_single_env, entry_addr);
+    if (ptr) {
+	memcpy(&entry, ptr, len);
+    } else {
+	/* TLB miss, or the entry crosses a page */
+	mtrace_cpu_stats[cpu_single_env->cpu_index].rw_debug++;
+	r = cpu_memory_rw_debug(cpu_single_env, entry_addr,
+				(uint8_t *)&entry, len, 0);
+	if (r) {
+	    fprintf(stderr, "mtrace_entry_register: cpu_memory_rw_debug failed\n");
+	    return;
+	}
+    }
+
+    /* Host entries may change the mode, so catch up on every ring */
+    if (mtrace_guest_nrings && type == mtrace_entry_host)
+	mtrace_guest_ring_drain_all(mtrace_access_count);
+
+    mtrace_entry_process(cpu_single_env, &entry, type, len,
+			 mtrace_access_count);
+}
+
+/*
+ * Guest rings.  ring is the guest's mtrace_guest_ring, mapped straight
+ * from guest RAM.
+ */
+struct mtrace_guest_ring_info {
+    struct mtrace_guest_ring *ring;
+    uint64_t size;
+    CPUX86State *env;
+};
+
+static struct mtrace_guest_ring_info mtrace_guest_rings[255];
+
+static void mtrace_guest_ring_drain(int cpu, uint64_t access_count)
+{
+    static int draining;
+    struct mtrace_guest_ring_info *g = &mtrace_guest_rings[cpu];
+    struct mtrace_guest_ring *ring = g->ring;
+    union mtrace_entry entry;
+    uint64_t head, off, contig;
+    uint32_t type;
+    uint16_t len;
+
+    /* Entries logged while draining don't drain again */
+    if (ring == NULL || draining)
+	return;
+    draining = 1;
+
+    for (head = ring->head; head != ring->tail; ring->head = head) {
+	if (ring->tail - head > g->size || (head & 7))
+	    goto bad;
+	off = head & (g->size - 1);
+	contig = g->size - off;
+	memcpy(&type, &ring->buf[off], sizeof(type));
+	if (type == 0) {
+	    head += contig;
+	    continue;
 	}
+	if (contig < sizeof(entry.h))
+	    goto bad;
+	memcpy(&entry.h, &ring->buf[off], sizeof(entry.h));
+	len = entry.h.size;
+	if (len < sizeof(entry.h) || len > sizeof(entry) || len > contig ||
+	    type == mtrace_entry_host)
+	    goto bad;
+	/* Short entries leave the rest zeroed, not stack garbage */
+	memset(&entry, 0, sizeof(entry));
+	memcpy(&entry, &ring->buf[off], len);
+	head += (len + 7) & ~7;
+	mtrace_entry_process(g->env, &entry, type, len, access_count);
+    }
+    draining = 0;
+    return;
+
+bad:
+    fprintf(stderr, "mtrace: bad entry in CPU %d's guest ring at %"PRIu64
+	    ", dropping %"PRIu64" bytes\n", cpu, head, ring->tail - head);
+    ring->head = ring->tail;
+    draining = 0;
+}
+
+/* Drains every non-empty ring, so the log stays in access_count order
+ * across CPUs */
+static void mtrace_guest_ring_drain_all(uint64_t access_count)
+{
+    struct mtrace_guest_ring *ring;
+    int cpu;
+
+    for (cpu = 0; cpu < smp_cpus; cpu++) {
+	ring = mtrace_guest_rings[cpu].ring;
+	if (ring && ring->head != ring->tail)
+	    mtrace_guest_ring_drain(cpu, access_count);
+    }
+}
+
+/*
+ * Called as a CPU stops executing.  Another CPU may run next, so log
+ * what this one appended while it's still in order.
+ */
+void mtrace_cpu_exec_exit(int cpu)
+{
+    if (mtrace_guest_nrings)
+	mtrace_guest_ring_drain(cpu, mtrace_access_count);
+}
+
+static void mtrace_guest_ring_unregister(int cpu)
+{
+    if (mtrace_guest_rings[cpu].ring == NULL)
+	return;
+    mtrace_guest_rings[cpu].ring = NULL;
+    mtrace_guest_nrings--;
+}
+
+static void mtrace_ring_register(target_ulong ring_addr, target_ulong size,
+				 target_ulong n3, target_ulong n4,
+				 target_ulong n5)
+{
+    CPUX86State *env = cpu_single_env;
+    int cpu = env->cpu_index;
+    target_ulong host, page_host;
+    target_ulong addr, end;
+
+    mtrace_guest_ring_drain(cpu, mtrace_access_count);
+    mtrace_guest_ring_unregister(cpu);
+    if (ring_addr == 0)
+	return;
+
+    if (size < 64 || (size & (size - 1))) {
+	fprintf(stderr, "mtrace_ring_register: bad size %"PRIu64"\n",
+		(uint64_t)size);
+	return;
+    }
+
+    /* The ring has to be contiguous in host memory as well */
+    end = ring_addr + sizeof(struct mtrace_guest_ring) + size;
+    if (mtrace_host_addr(env, ring_addr, &host))
+	goto bad;
+    for (addr = (ring_addr & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE; addr < end;
+	 addr += TARGET_PAGE_SIZE) {
+	if (mtrace_host_addr(env, addr, &page_host) ||
+	    page_host != host + (addr - ring_addr))
+	    goto bad;
     }
 
-    mtrace_log_entry(&entry);
+    mtrace_guest_rings[cpu].ring =
+	(struct mtrace_guest_ring *)(uintptr_t)host;
+    mtrace_guest_rings[cpu].size = size;
+    mtrace_guest_rings[cpu].env = env;
+    mtrace_guest_rings[cpu].ring->size = size;
+    mtrace_guest_nrings++;
+    return;
+
+bad:
+    fprintf(stderr, "mtrace_ring_register: ring at %"PRIx64" is not "
+	    "contiguous RAM\n", (uint64_t)ring_addr);
+}
+
+static void mtrace_ring_flush(target_ulong n1, target_ulong n2,
+			      target_ulong n3, target_ulong n4,
+			      target_ulong n5)
+{
+    mtrace_guest_ring_drain(cpu_single_env->cpu_index, mtrace_access_count);
+}
+
+static void mtrace_guest_rings_reset(void *opaque)
+{
+    int cpu;
+
+    for (cpu = 0; cpu < smp_cpus; cpu++)
+	mtrace_guest_ring_unregister(cpu);
 }
 
 static void (*mtrace_call[])(target_ulong, target_ulong, target_ulong,
 			     target_ulong, target_ulong) = 
 {
     [MTRACE_ENTRY_REGISTER]	= mtrace_entry_register,
+    [MTRACE_RING_REGISTER]	= mtrace_ring_register,
+    [MTRACE_RING_FLUSH]		= mtrace_ring_flush,
 };
 
 void mtrace_inst_exec(target_ulong a0, target_ulong a1, 
@@ -772,10 +3049,99 @@ void mtrace_inst_exec(target_ulong a0, target_ulong a1,
     mtrace_call[a0](a1, a2, a3, a4, a5);
 }
 
+/*
+ * Interned call stacks for MTRACE_FORMAT_V4, indexed by id.  Each is a
+ * push onto its parent, and mtrace_stack_hash finds the id of a push
+ * (0 marks a free slot, since the empty stack is never a push).
+ */
+struct mtrace_stack_node {
+    uint32_t parent;
+    uint64_t target_pc;
+    uint64_t return_pc;
+};
+
+static struct mtrace_stack_node *mtrace_stacks;
+static uint32_t mtrace_nstacks = 1;
+static uint32_t mtrace_stacks_size;
+static uint32_t *mtrace_stack_hash;
+static uint32_t mtrace_stack_hash_size;
+
+static uint32_t *mtrace_stack_slot(uint32_t parent, uint64_t target_pc,
+				   uint64_t return_pc)
+{
+    uint64_t h = (target_pc * 0x9e3779b97f4a7c15ULL) ^ return_pc ^ parent;
+    uint32_t i = (h ^ (h >> 29)) & (mtrace_stack_hash_size - 1);
+    struct mtrace_stack_node *n;
+
+    for (;; i = (i + 1) & (mtrace_stack_hash_size - 1)) {
+	if (mtrace_stack_hash[i] == 0)
+	    return &mtrace_stack_hash[i];
+	n = &mtrace_stacks[mtrace_stack_hash[i]];
+	if (n->parent == parent && n->target_pc == target_pc &&
+	    n->return_pc == return_pc)
+	    return &mtrace_stack_hash[i];
+    }
+}
+
+static void mtrace_stack_hash_grow(void)
+{
+    struct mtrace_stack_node *n;
+    uint32_t id;
+
+    qemu_free(mtrace_stack_hash);
+    mtrace_stack_hash_size = mtrace_stack_hash_size ?
+	mtrace_stack_hash_size * 2 : 4096;
+    mtrace_stack_hash = qemu_mallocz(mtrace_stack_hash_size *
+				     sizeof(mtrace_stack_hash[0]));
+    for (id = 1; id < mtrace_nstacks; id++) {
+	n = &mtrace_stacks[id];
+	*mtrace_stack_slot(n->parent, n->target_pc, n->return_pc) = id;
+    }
+}
+
+/* Returns the id of parent with a call pushed, logging it if it's new */
+static uint32_t mtrace_stack_push(uint32_t parent, uint64_t target_pc,
+				  uint64_t return_pc)
+{
+    struct mtrace_stack_entry entry;
+    uint32_t *slot;
+    uint32_t id;
+
+    if (mtrace_nstacks * 2 >= mtrace_stack_hash_size)
+	mtrace_stack_hash_grow();
+    slot = mtrace_stack_slot(parent, target_pc, return_pc);
+    if (*slot)
+	return *slot;
+
+    if (mtrace_nstacks >= mtrace_stacks_size) {
+	mtrace_stacks_size = mtrace_stacks_size ? mtrace_stacks_size * 2 : 4096;
+	mtrace_stacks = qemu_realloc(mtrace_stacks, mtrace_stacks_size *
+				     sizeof(mtrace_stacks[0]));
+    }
+    id = *slot = mtrace_nstacks++;
+    mtrace_stacks[id].parent = parent;
+    mtrace_stacks[id].target_pc = target_pc;
+    mtrace_stacks[id].return_pc = return_pc;
+
+    entry.h.type = mtrace_entry_stack;
+    entry.h.size = sizeof(entry);
+    entry.h.cpu = cpu_single_env->cpu_index;
+    entry.h.access_count = mtrace_access_count;
+    entry.h.ts = 0;
+    entry.id = id;
+    entry.parent = parent;
+    entry.target_pc = target_pc;
+    entry.return_pc = return_pc;
+    mtrace_log_entry((union mtrace_entry *)&entry);
+    return id;
+}
+
 void mtrace_inst_call(target_ulong target_pc, target_ulong return_pc,
 		      int ret)
 {
+    struct mtrace_call_stack_info *s;
     struct mtrace_call_entry call;    
+    uint32_t id;
     int cpu;
 
     if (!mtrace_system_enable || !mtrace_call_trace)
@@ -783,9 +3149,30 @@ void mtrace_inst_call(target_ulong target_pc, target_ulong return_pc,
 
     cpu = cpu_single_env->cpu_index;
 
+    /* Ring entries may switch, grow or remove this CPU's call stack */
+    if (mtrace_guest_nrings)
+	mtrace_guest_ring_drain(cpu, mtrace_access_count);
+
     if (!mtrace_call_stack_active[cpu])
 	return;
 
+    /* Follow the shadow stack instead of logging calls */
+    if (mtrace_format >= MTRACE_FORMAT_V4) {
+	s = mtrace_my_call_stack(cpu);
+	if (s == NULL)
+	    return;
+	if (ret) {
+	    s->stack_id = s->stack_id ? mtrace_stacks[s->stack_id].parent : 0;
+	    return;
+	}
+	/* Logging a new stack can drain the ring, so look s up again */
+	id = mtrace_stack_push(s->stack_id, target_pc, return_pc);
+	s = mtrace_my_call_stack(cpu);
+	if (s)
+	    s->stack_id = id;
+	return;
+    }
+
     call.h.type = mtrace_entry_call;
     call.h.size = sizeof(call);
     call.h.cpu = cpu;
@@ -800,39 +3187,130 @@ void mtrace_inst_call(target_ulong target_pc, target_ulong return_pc,
 
 void mtrace_cline_track_free(RAMBlock *block)
 {
-    if (block->cline_track)
+    CPUX86State *env;
+
+    if (block->cline_track) {
 	qemu_vfree(block->cline_track);
-    block->cline_track = NULL;
+	block->cline_track = NULL;
+	qemu_free(block->cline_epoch);
+	block->cline_epoch = NULL;
+	/* Drop any mtrace_cline_tlb entries pointing into it */
+	if (mtrace_instrument == mtrace_instrument_filter)
+	    for (env = first_cpu; env != NULL; env = env->next_cpu)
+		mtrace_cline_tlb_refill(env);
+    }
     block->cline_track_size = 0;
+    mtrace_cline_sharers_free(block);
+}
+
+static void mtrace_stats_sum(struct mtrace_stats_entry *e)
+{
+    struct mtrace_cpu_stats *c;
+    int cpu, i;
+
+    memset(e, 0, sizeof(*e));
+    for (cpu = 0; cpu < smp_cpus; cpu++) {
+	c = &mtrace_cpu_stats[cpu];
+	for (i = 0; i < MTRACE_STATS_TYPES; i++)
+	    e->entries[i] += c->entries[i];
+	e->sample_drops += c->sample_drops;
+	e->filter_drops += c->filter_drops;
+	for (i = 0; i < 4; i++)
+	    e->cache[i] += c->cache[i];
+	e->get_pc += c->get_pc;
+	e->get_pc_slow += c->get_pc_slow;
+	e->rw_debug += c->rw_debug;
+    }
+    e->ring_stalls = mtrace_ring_stalls;
+    e->ring_stall_ns = mtrace_ring_stall_ns;
+    e->bytes_in = mtrace_bytes_in;
+    e->bytes_out = mtrace_bytes_out;
+    e->write_ns = mtrace_write_ns;
+}
+
+/* End the log file with the counters so far */
+static void mtrace_stats_log(void)
+{
+    struct mtrace_stats_entry entry;
+
+    mtrace_stats_sum(&entry);
+    entry.h.type = mtrace_entry_stats;
+    entry.h.size = sizeof(entry);
+    entry.h.cpu = 0;
+    entry.h.access_count = mtrace_access_count;
+    entry.h.ts = 0;
+    mtrace_log_entry((union mtrace_entry *)&entry);
+}
+
+static void mtrace_stats_print(void)
+{
+    struct mtrace_cpu_stats *c;
+    uint64_t n;
+    int cpu, i;
+
+    for (cpu = 0; cpu < smp_cpus; cpu++) {
+	c = &mtrace_cpu_stats[cpu];
+	for (n = 0, i = 0; i < MTRACE_STATS_TYPES; i++)
+	    n += c->entries[i];
+	fprintf(stderr, "mtrace: cpu %d: %"PRIu64" entries (%"PRIu64
+		" accesses), %"PRIu64" sample drops, %"PRIu64" filter drops, "
+		"%"PRIu64" pc lookups (%"PRIu64" slow), %"PRIu64
+		" debug reads\n", cpu, n, c->entries[mtrace_entry_access],
+		c->sample_drops, c->filter_drops, c->get_pc, c->get_pc_slow,
+		c->rw_debug);
+	if (mtrace_cache_ways)
+	    fprintf(stderr, "mtrace: cpu %d: cache %"PRIu64" hits, %"PRIu64
+		    " misses, %"PRIu64" coherence misses\n", cpu,
+		    c->cache[mtrace_cache_hit], c->cache[mtrace_cache_miss],
+		    c->cache[mtrace_cache_coherence]);
+    }
+    fprintf(stderr, "mtrace: writer: %"PRIu64" bytes in, %"PRIu64
+	    " bytes out, %"PRIu64" ms writing, %"PRIu64" stalls (%"PRIu64
+	    " ms)\n", mtrace_bytes_in, mtrace_bytes_out,
+	    mtrace_write_ns / 1000000, mtrace_ring_stalls,
+	    mtrace_ring_stall_ns / 1000000);
+}
+
+static void mtrace_stats_tick(void *opaque)
+{
+    mtrace_stats_print();
+    qemu_mod_timer(mtrace_stats_timer, qemu_get_clock(rt_clock) +
+		   mtrace_stats_interval * 1000);
 }
 
 static void mtrace_cleanup(void)
 {
+    int cpu;
+
+    for (cpu = 0; cpu < smp_cpus; cpu++)
+	mtrace_guest_ring_drain(cpu, mtrace_access_count);
+    if (mtrace_aggregate)
+	mtrace_aggregate_flush();
+    if (mtrace_file)
+	mtrace_stats_log();
+    if (mtrace_call_stack_stats.lookups)
+	fprintf(stderr, "mtrace: call stack table: %"PRIu64" live, %"PRIu64
+		" peak, %u slots, %.2f probes per lookup\n",
+		mtrace_call_stack_stats.live, mtrace_call_stack_stats.peak,
+		1U << mtrace_per_call_stack_bits,
+		(double)mtrace_call_stack_stats.probes /
+		mtrace_call_stack_stats.lookups);
     if (mtrace_file) {
-	mtrace_log_entry(NULL);
+	mtrace_writer_stop();
 	close(mtrace_file);
-	if (child_pid) {
-	    if (waitpid(child_pid, NULL, 0) < 0) {
-		if (errno != ECHILD && errno != EINTR) {
-		    perror("mtrace_cleanup: waitpid");
-		    abort();
-		}
-	    }
-	}
+	if (mtrace_index)
+	    fclose(mtrace_index);
+	mtrace_index = NULL;
     }
     mtrace_file = 0;
+    if (mtrace_stats_interval)
+	mtrace_stats_print();
 }
 
-void mtrace_init(void)
+static void mtrace_log_machine(void)
 {
     struct mtrace_machine_entry entry;
 
-    if (!mtrace_system_enable)
-	return;
-
-    if (mtrace_file == 0)
-	mtrace_log_file_set("mtrace.out");
-
     entry.h.type = mtrace_entry_machine;
     entry.h.size = sizeof(entry);
     entry.h.cpu = 0;
@@ -843,9 +3321,300 @@ void mtrace_init(void)
     entry.num_ram = ram_size;
     entry.quantum = mtrace_quantum;
     entry.sample = mtrace_sample;
+    entry.sample_mode = mtrace_sample_mode;
+    entry.sample_burst = mtrace_sample_insns;
     entry.locked = mtrace_lock_trace;
     entry.calls = mtrace_call_trace;
+    entry.format = mtrace_format;
+    entry.cline_shift = mtrace_cline_shift;
+    entry.cache_size = mtrace_cache_size;
+    entry.cache_ways = mtrace_cache_ways;
     mtrace_log_entry((union mtrace_entry *)&entry);
-    
+}
+
+void mtrace_init(void)
+{
+    if (!mtrace_system_enable)
+	return;
+
+    /* Owner ids have to leave room for MTRACE_CLINE_UNTRACKED */
+    if (smp_cpus > MTRACE_CLINE_UNTRACKED) {
+	fprintf(stderr, "mtrace: at most %d CPUs\n", MTRACE_CLINE_UNTRACKED);
+	exit(1);
+    }
+    if (mtrace_cache_ways) {
+	uint64_t lines = mtrace_cache_size >> mtrace_cline_shift;
+
+	mtrace_cache_sets = lines / mtrace_cache_ways;
+	if (mtrace_cache_sets == 0 ||
+	    (mtrace_cache_sets & (mtrace_cache_sets - 1)) ||
+	    mtrace_cache_sets * mtrace_cache_ways << mtrace_cline_shift !=
+	    mtrace_cache_size) {
+	    fprintf(stderr, "mtrace: a %"PRIu64"-byte %d-way cache doesn't "
+		    "have a power of two sets of %d-byte lines\n",
+		    mtrace_cache_size, mtrace_cache_ways,
+		    1 << mtrace_cline_shift);
+	    exit(1);
+	}
+    }
+    if (mtrace_file == 0)
+	mtrace_log_file_set("mtrace.out");
+    if (mtrace_rings == NULL) {
+	mtrace_writer_start();
+	qemu_register_reset(mtrace_guest_rings_reset, NULL);
+    }
+
+    mtrace_log_machine();
+    if (mtrace_stats_interval) {
+	mtrace_stats_timer = qemu_new_timer(rt_clock, mtrace_stats_tick, NULL);
+	mtrace_stats_tick(NULL);
+    }
     atexit(mtrace_cleanup);
 }
+
+/*
+ * Monitor commands.  They run with the global mutex held, so never
+ * while the TCG thread is logging.
+ */
+static int mtrace_monitor_check(void)
+{
+    if (!mtrace_system_enable || mtrace_rings == NULL) {
+	qerror_report(QERR_DEVICE_NOT_ACTIVE, "mtrace");
+	return -1;
+    }
+    return 0;
+}
+
+/* Everything the guest logged so far, through to the log file */
+static void mtrace_flush(void)
+{
+    int cpu;
+
+    for (cpu = 0; cpu < smp_cpus; cpu++)
+	mtrace_guest_ring_drain(cpu, mtrace_access_count);
+    mtrace_writer_sync();
+    mtrace_writer_resume();
+}
+
+static void do_info_mtrace_cpu_print(QObject *obj, void *opaque)
+{
+    QDict *cpu = qobject_to_qdict(obj);
+
+    monitor_printf((Monitor *)opaque, "cpu %"PRId64": entries %"PRId64
+		   "  sample drops %"PRId64"  filter drops %"PRId64
+		   "  pc lookups %"PRId64" (%"PRId64" slow)  debug reads %"PRId64
+		   "\n",
+		   qdict_get_int(cpu, "cpu"), qdict_get_int(cpu, "entries"),
+		   qdict_get_int(cpu, "sample-drops"),
+		   qdict_get_int(cpu, "filter-drops"),
+		   qdict_get_int(cpu, "get-pc"),
+		   qdict_get_int(cpu, "get-pc-slow"),
+		   qdict_get_int(cpu, "rw-debug"));
+    if (mtrace_cache_ways)
+	monitor_printf((Monitor *)opaque, "cpu %"PRId64": cache %"PRId64
+		       " hits, %"PRId64" misses, %"PRId64" coherence misses\n",
+		       qdict_get_int(cpu, "cpu"),
+		       qdict_get_int(cpu, "cache-hits"),
+		       qdict_get_int(cpu, "cache-misses"),
+		       qdict_get_int(cpu, "cache-coherence"));
+}
+
+void do_info_mtrace_print(Monitor *mon, const QObject *data)
+{
+    QDict *qdict = qobject_to_qdict(data);
+
+    if (!qdict_get_bool(qdict, "enabled")) {
+	monitor_printf(mon, "mtrace: disabled\n");
+	return;
+    }
+    monitor_printf(mon, "mtrace: logging to %s (format %"PRId64")\n",
+		   qdict_get_str(qdict, "file"),
+		   qdict_get_int(qdict, "format"));
+    monitor_printf(mon, "mode %"PRId64"  sample %"PRId64" (%s)  quantum %"PRId64
+		   "  calls %s  locks %s\n",
+		   qdict_get_int(qdict, "mode"),
+		   qdict_get_int(qdict, "sample"),
+		   qdict_get_str(qdict, "sample-mode"),
+		   qdict_get_int(qdict, "quantum"),
+		   qdict_get_bool(qdict, "calls") ? "on" : "off",
+		   qdict_get_bool(qdict, "locks") ? "on" : "off");
+    monitor_printf(mon, "accesses %"PRId64"  entries %"PRId64
+		   "  writer stalls %"PRId64" (%"PRId64" ms)\n",
+		   qdict_get_int(qdict, "accesses"),
+		   qdict_get_int(qdict, "entries"),
+		   qdict_get_int(qdict, "stalls"),
+		   qdict_get_int(qdict, "stall-ms"));
+    monitor_printf(mon, "call stacks %"PRId64" (peak %"PRId64")\n",
+		   qdict_get_int(qdict, "call-stacks"),
+		   qdict_get_int(qdict, "call-stacks-peak"));
+    monitor_printf(mon, "log bytes in %"PRId64"  out %"PRId64
+		   "  writing %"PRId64" ms\n",
+		   qdict_get_int(qdict, "bytes-in"),
+		   qdict_get_int(qdict, "bytes-out"),
+		   qdict_get_int(qdict, "write-ms"));
+    qlist_iter(qdict_get_qlist(qdict, "cpus"), do_info_mtrace_cpu_print, mon);
+}
+
+static const char *mtrace_sample_modes[] = {
+    [mtrace_sample_count] = "count",
+    [mtrace_sample_random] = "random",
+    [mtrace_sample_line] = "line",
+    [mtrace_sample_burst] = "burst",
+};
+
+void do_info_mtrace(Monitor *mon, QObject **ret_data)
+{
+    struct mtrace_cpu_stats *c;
+    QList *cpus;
+    uint64_t n;
+    int cpu, i;
+
+    if (!mtrace_system_enable || mtrace_rings == NULL) {
+	*ret_data = qobject_from_jsonf("{ 'enabled': false }");
+	return;
+    }
+    *ret_data = qobject_from_jsonf(
+	"{ 'enabled': true, 'file': %s, 'format': %d, 'mode': %d, "
+	"'sample': %d, 'sample-mode': %s, 'quantum': %d, 'calls': %i, "
+	"'locks': %i, "
+	"'accesses': %" PRId64 ", 'entries': %" PRId64 ", "
+	"'stalls': %" PRId64 ", 'stall-ms': %" PRId64 ", "
+	"'call-stacks': %" PRId64 ", 'call-stacks-peak': %" PRId64 ", "
+	"'bytes-in': %" PRId64 ", 'bytes-out': %" PRId64 ", "
+	"'write-ms': %" PRId64 " }",
+	mtrace_file_path, mtrace_format, mtrace_mode, mtrace_sample,
+	mtrace_sample_modes[mtrace_sample_mode], mtrace_quantum, mtrace_call_trace, mtrace_lock_trace,
+	mtrace_access_count, mtrace_log_seq, mtrace_ring_stalls,
+	mtrace_ring_stall_ns / 1000000, mtrace_call_stack_stats.live,
+	mtrace_call_stack_stats.peak, mtrace_bytes_in, mtrace_bytes_out,
+	mtrace_write_ns / 1000000);
+
+    cpus = qlist_new();
+    for (cpu = 0; cpu < smp_cpus; cpu++) {
+	c = &mtrace_cpu_stats[cpu];
+	for (n = 0, i = 0; i < MTRACE_STATS_TYPES; i++)
+	    n += c->entries[i];
+	qlist_append_obj(cpus, qobject_from_jsonf(
+	    "{ 'cpu': %d, 'entries': %" PRId64 ", 'sample-drops': %" PRId64
+	    ", 'filter-drops': %" PRId64 ", 'get-pc': %" PRId64
+	    ", 'get-pc-slow': %" PRId64 ", 'rw-debug': %" PRId64
+	    ", 'cache-hits': %" PRId64 ", 'cache-misses': %" PRId64
+	    ", 'cache-coherence': %" PRId64 " }", cpu, n, c->sample_drops,
+	    c->filter_drops, c->get_pc, c->get_pc_slow, c->rw_debug,
+	    c->cache[mtrace_cache_hit], c->cache[mtrace_cache_miss],
+	    c->cache[mtrace_cache_coherence]));
+    }
+    qdict_put(qobject_to_qdict(*ret_data), "cpus", cpus);
+}
+
+int do_mtrace_sample(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    int64_t n = qdict_get_int(qdict, "value");
+
+    if (mtrace_monitor_check())
+	return -1;
+    if (n < 1 || n > INT_MAX) {
+	qerror_report(QERR_INVALID_PARAMETER_VALUE, "value", "a positive rate");
+	return -1;
+    }
+    mtrace_sample = n;
+    memset(mtrace_sampler, 0, sizeof(mtrace_sampler));
+    /* So the log says how the accesses that follow were sampled */
+    mtrace_log_machine();
+    return 0;
+}
+
+int do_mtrace_quantum(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    int64_t n = qdict_get_int(qdict, "value");
+
+    if (mtrace_monitor_check())
+	return -1;
+    if (n < 0 || n > INT_MAX) {
+	qerror_report(QERR_INVALID_PARAMETER_VALUE, "value",
+		      "a number of blocks");
+	return -1;
+    }
+    mtrace_quantum = n;
+    return 0;
+}
+
+int do_mtrace_calls(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    if (mtrace_monitor_check())
+	return -1;
+    mtrace_call_trace = qdict_get_bool(qdict, "enable");
+    return 0;
+}
+
+int do_mtrace_locks(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    CPUX86State *env;
+
+    if (mtrace_monitor_check())
+	return -1;
+    mtrace_lock_trace = qdict_get_bool(qdict, "enable");
+    if (!mtrace_lock_trace) {
+	/* mtrace_lock_stop won't be around to end these */
+	for (env = first_cpu; env != NULL; env = env->next_cpu) {
+	    mtrace_lock_active[env->cpu_index] = 0;
+	    mtrace_cline_mask_update(env);
+	}
+    }
+    return 0;
+}
+
+int do_mtrace_flush(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    if (mtrace_monitor_check())
+	return -1;
+    mtrace_flush();
+    return 0;
+}
+
+/*
+ * Finish the log and continue in a new file.  The old file ends with
+ * the counters so far, as it would at exit.  The new file starts with
+ * a new segment, so it has its own machine entry and the call stacks
+ * logged so far; labels and other state the guest logged earlier stay
+ * in the old file.
+ */
+int do_mtrace_rotate(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    const char *path = qdict_get_str(qdict, "filename");
+    int fd, fifo;
+    uint32_t id;
+
+    if (mtrace_monitor_check())
+	return -1;
+    fd = mtrace_log_open(path, &fifo);
+    if (fd < 0) {
+	qerror_report(QERR_OPEN_FILE_FAILED, path);
+	return -1;
+    }
+    if (fifo != mtrace_file_fifo) {
+	close(fd);
+	qerror_report(QERR_INVALID_PARAMETER_VALUE, "filename",
+		      mtrace_file_fifo ? "a FIFO" : "a regular file");
+	return -1;
+    }
+
+    for (id = 0; id < (uint32_t)smp_cpus; id++)
+	mtrace_guest_ring_drain(id, mtrace_access_count);
+    mtrace_stats_log();
+    mtrace_writer_sync();
+    close(mtrace_file);
+    mtrace_file = fd;
+    mtrace_file_offset = 0;
+    qemu_free(mtrace_file_path);
+    mtrace_file_path = qemu_strdup(path);
+    if (mtrace_index) {
+	fclose(mtrace_index);
+	mtrace_index_open(path);
+    }
+    mtrace_writer_resume();
+
+    /* Starts the new file's first segment */
+    mtrace_log_machine();
+    return 0;
+}
@@ -1,12 +1,41 @@
 #ifndef _MTRACE_H_
 #define _MTRACE_H_
 
+#include "qdict.h"
+
 struct RAMBlock;
 
+/* log2 of the tracking granularity (64-byte cache lines by default) */
+extern int mtrace_cline_shift;
+
+/* Flavors of instrumentation in translated code */
+typedef enum {
+    mtrace_instrument_none = 0,
+    /* Call mtrace_tcg_ld/st for every access */
+    mtrace_instrument_call,
+    /* Check cline_track inline, call out only if the line moves */
+    mtrace_instrument_filter,
+} mtrace_instrument_t;
+
+/* Encodings of RAMBlock::cline_track in movement mode */
+typedef enum {
+    /* Bit i set if CPU i has a copy of the line (up to 8 CPUs) */
+    mtrace_cline_bitmap = 0,
+    /* cpu_index of the only CPU with a copy, or "shared" */
+    mtrace_cline_owner,
+} mtrace_cline_encoding_t;
+
+/* Counts every access, including those the inline filter drops */
+extern uint64_t mtrace_access_count;
+
 /* mtrace.c */
 void mtrace_init(void);
+void mtrace_cpu_exec_exit(int cpu);
+void mtrace_tb_abort(void);
 
 void mtrace_cline_track_free(struct RAMBlock *block);
+unsigned long mtrace_cline_tlb_addend(void *host_page);
+mtrace_cline_encoding_t mtrace_cline_encoding_get(void);
 
 void mtrace_log_file_set(const char *path);
 void mtrace_system_enable_set(int b);
@@ -14,9 +43,28 @@ int  mtrace_system_enable_get(void);
 void mtrace_cline_trace_set(int b);
 void mtrace_call_trace_set(int b);
 void mtrace_lock_trace_set(int b);
-void mtrace_sample_set(int n);
+int  mtrace_sample_parse(const char *spec);
+void mtrace_buffer_set(uint64_t bytes);
+void mtrace_segment_set(uint64_t bytes);
+int  mtrace_granularity_set(uint64_t bytes);
+int  mtrace_cache_set(uint64_t bytes, int ways);
+int  mtrace_filter_parse(const char *spec);
+void mtrace_compress_set(int level);
+void mtrace_format_set(int format);
 int  mtrace_enable_get(void);
+int  mtrace_instrument_get(void);
 void mtrace_quantum_set(int n);
+void mtrace_stats_interval_set(int seconds);
 int  mtrace_quantum_get(void);
 
+/* Monitor commands */
+void do_info_mtrace_print(Monitor *mon, const QObject *data);
+void do_info_mtrace(Monitor *mon, QObject **ret_data);
+int do_mtrace_sample(Monitor *mon, const QDict *qdict, QObject **ret_data);
+int do_mtrace_quantum(Monitor *mon, const QDict *qdict, QObject **ret_data);
+int do_mtrace_calls(Monitor *mon, const QDict *qdict, QObject **ret_data);
+int do_mtrace_locks(Monitor *mon, const QDict *qdict, QObject **ret_data);
+int do_mtrace_flush(Monitor *mon, const QDict *qdict, QObject **ret_data);
+int do_mtrace_rotate(Monitor *mon, const QDict *qdict, QObject **ret_data);
+
 #endif
@@ -1027,13 +1027,57 @@ DEF("mtrace-calls", 0, QEMU_OPTION_mtrace_calls,
     "-mtrace-calls   Log all retired call and ret instructions\n"
     "                (the default is to ignore call and ret instructions)\n", QEMU_ARCH_I386)
 DEF("mtrace-sample", HAS_ARG, QEMU_OPTION_mtrace_sample,
-    "-mtrace-sample N\n"
-    "                record 1 out of every N memory accesses\n"
-    "                (the default is 1)\n", QEMU_ARCH_I386)
+    "-mtrace-sample N[,random|line|burst=instructions]\n"
+    "                record 1 out of every N memory accesses on each CPU:\n"
+    "                every Nth (the default), at random, all accesses to\n"
+    "                1 out of N lines, or bursts of the given number of\n"
+    "                instructions (the default N is 1)\n", QEMU_ARCH_I386)
 DEF("mtrace-quantum", HAS_ARG, QEMU_OPTION_mtrace_quantum,
     "-mtrace-quantum N\n"
-    "                switch a core if it has executed N instructions\n"
+    "                switch a core if it has executed N translation blocks\n"
     "                (the default is 0, which disables this feature)\n", QEMU_ARCH_I386)
+DEF("mtrace-compress", HAS_ARG, QEMU_OPTION_mtrace_compress,
+    "-mtrace-compress level\n"
+    "                gzip level for the memory trace log, 0 (store only)\n"
+    "                to 9 (the default is 6)\n", QEMU_ARCH_I386)
+DEF("mtrace-format", HAS_ARG, QEMU_OPTION_mtrace_format,
+    "-mtrace-format N\n"
+    "                memory trace log format version, 1 to 6 (the default\n"
+    "                is 6, which compacts access entries, interns names,\n"
+    "                logs call stack ids instead of calls and returns,\n"
+    "                stamps accesses with instruction counts and compacts\n"
+    "                cache results)\n", QEMU_ARCH_I386)
+DEF("mtrace-buffer", HAS_ARG, QEMU_OPTION_mtrace_buffer,
+    "-mtrace-buffer size\n"
+    "                buffer up to size bytes of log per CPU for the writer\n"
+    "                thread (the default is 1M)\n", QEMU_ARCH_I386)
+DEF("mtrace-segment", HAS_ARG, QEMU_OPTION_mtrace_segment,
+    "-mtrace-segment size\n"
+    "                start a new self-contained segment of the memory trace\n"
+    "                log every size bytes, before compression, and at every\n"
+    "                mode switch; filename.idx lists the segments (the\n"
+    "                default is 64M)\n", QEMU_ARCH_I386)
+DEF("mtrace-granularity", HAS_ARG, QEMU_OPTION_mtrace_granularity,
+    "-mtrace-granularity bytes\n"
+    "                track sharing and movement in blocks of bytes, a power\n"
+    "                of two from 8 to the page size (the default is 64)\n",
+    QEMU_ARCH_I386)
+DEF("mtrace-filter", HAS_ARG, QEMU_OPTION_mtrace_filter,
+    "-mtrace-filter rule[,rule...]\n"
+    "                only log accesses that match a rule: virt=start-end or\n"
+    "                phys=start-end for an address range, or type=heap|block|\n"
+    "                static|percpu or label=name for objects the guest labels\n"
+    "                from then on (may be repeated)\n", QEMU_ARCH_I386)
+DEF("mtrace-cache", HAS_ARG, QEMU_OPTION_mtrace_cache,
+    "-mtrace-cache size[,ways]\n"
+    "                in movement mode, simulate a private MESI cache of\n"
+    "                size bytes per CPU, ways-way set associative (the\n"
+    "                default is 8), and log only its misses, each marked\n"
+    "                as a cold/capacity or coherence miss\n", QEMU_ARCH_I386)
+DEF("mtrace-stats", HAS_ARG, QEMU_OPTION_mtrace_stats,
+    "-mtrace-stats N\n"
+    "                print the memory trace recorder's counters every N\n"
+    "                seconds and at exit (the default is 0, never)\n", QEMU_ARCH_I386)
 
 DEFHEADING()
 STEXI
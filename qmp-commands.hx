@@ -502,6 +502,171 @@ EQMP
         .mhandler.cmd_new = do_migrate_set_speed,
     },
 
+#if defined(TARGET_I386)
+
+SQMP
+mtrace_sample
+-------------
+
+Log only one in every "value" memory accesses, with the sampling mode
+set by -mtrace-sample.
+
+Arguments:
+
+- "value": sampling rate, at least 1 (json-int)
+
+Example:
+
+-> { "execute": "mtrace_sample", "arguments": { "value": 10 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "mtrace_sample",
+        .args_type  = "value:i",
+        .params     = "rate",
+        .help       = "set mtrace to log one in every rate accesses",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_mtrace_sample,
+    },
+
+SQMP
+mtrace_quantum
+--------------
+
+Run each CPU for "value" translation blocks before switching to the
+next; 0 restores the default.
+
+Arguments:
+
+- "value": number of blocks (json-int)
+
+Example:
+
+-> { "execute": "mtrace_quantum", "arguments": { "value": 100 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "mtrace_quantum",
+        .args_type  = "value:i",
+        .params     = "blocks",
+        .help       = "set the number of blocks mtrace runs each CPU for before switching",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_mtrace_quantum,
+    },
+
+SQMP
+mtrace_calls
+------------
+
+Enable or disable tracing calls and returns.
+
+Arguments:
+
+- "enable": true to trace calls (json-bool)
+
+Example:
+
+-> { "execute": "mtrace_calls", "arguments": { "enable": true } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "mtrace_calls",
+        .args_type  = "enable:b",
+        .params     = "on|off",
+        .help       = "enable or disable mtrace call tracing",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_mtrace_calls,
+    },
+
+SQMP
+mtrace_locks
+------------
+
+Enable or disable tracing locked accesses.
+
+Arguments:
+
+- "enable": true to trace locks (json-bool)
+
+Example:
+
+-> { "execute": "mtrace_locks", "arguments": { "enable": false } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "mtrace_locks",
+        .args_type  = "enable:b",
+        .params     = "on|off",
+        .help       = "enable or disable mtrace lock tracing",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_mtrace_locks,
+    },
+
+SQMP
+mtrace_flush
+------------
+
+Wait until every entry mtrace has logged so far is in the log file.
+
+Arguments:
+
+None.
+
+Example:
+
+-> { "execute": "mtrace_flush" }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "mtrace_flush",
+        .args_type  = "",
+        .params     = "",
+        .help       = "write out everything mtrace has logged so far",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_mtrace_flush,
+    },
+
+SQMP
+mtrace_rotate
+-------------
+
+Write out and close the mtrace log, and continue logging to a new file.
+The new log starts with its own machine entry and the call stacks
+logged so far.
+
+Arguments:
+
+- "filename": the new log file (json-string)
+
+Example:
+
+-> { "execute": "mtrace_rotate",
+     "arguments": { "filename": "mtrace.out.1" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "mtrace_rotate",
+        .args_type  = "filename:F",
+        .params     = "filename",
+        .help       = "finish the mtrace log and continue in filename",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_mtrace_rotate,
+    },
+
+#endif
+
 SQMP
 client_migrate_info
 ------------------
@@ -1662,6 +1827,68 @@ Example:
 
 EQMP
 
+SQMP
+query-mtrace
+------------
+
+Show mtrace settings and statistics (x86 only).
+
+Return a json-object with the following information:
+
+- "enabled": true if mtrace is logging (json-bool)
+
+If mtrace is enabled, also:
+
+- "file": log file (json-string)
+- "format": log format version (json-int)
+- "mode": record mode (json-int)
+- "sample": one in every "sample" accesses is logged (json-int)
+- "sample-mode": how accesses are sampled: "count", "random", "line" or
+  "burst" (json-string)
+- "quantum": blocks each CPU runs before switching (json-int)
+- "calls": true if tracing calls (json-bool)
+- "locks": true if tracing locks (json-bool)
+- "accesses": accesses so far (json-int)
+- "entries": entries logged so far (json-int)
+- "stalls": times the guest waited for the log writer (json-int)
+- "stall-ms": milliseconds the guest waited for the log writer (json-int)
+- "call-stacks": live per-call-stack tags (json-int)
+- "call-stacks-peak": most live per-call-stack tags (json-int)
+- "bytes-in": log bytes encoded, before compression (json-int)
+- "bytes-out": log bytes written to the file (json-int)
+- "write-ms": milliseconds the writer spent writing the file (json-int)
+- "cpus": a json-array of per-CPU counters, each a json-object with:
+  - "cpu": CPU index (json-int)
+  - "entries": entries logged (json-int)
+  - "sample-drops": accesses skipped by sampling (json-int)
+  - "filter-drops": accesses skipped by the access filter (json-int)
+  - "get-pc": guest PC lookups (json-int)
+  - "get-pc-slow": guest PC lookups that retranslated a block (json-int)
+  - "rw-debug": guest entries read with cpu_memory_rw_debug (json-int)
+  - "cache-hits": cache model hits (json-int)
+  - "cache-misses": cache model misses, other than coherence misses
+    (json-int)
+  - "cache-coherence": cache model coherence misses (json-int)
+
+Example:
+
+-> { "execute": "query-mtrace" }
+<- { "return": { "enabled": true, "file": "mtrace.out", "format": 6,
+                 "mode": 1, "sample": 1, "sample-mode": "count",
+                 "quantum": 0, "calls": false,
+                 "locks": true, "accesses": 1843211, "entries": 52114,
+                 "stalls": 0, "stall-ms": 0, "call-stacks": 0,
+                 "call-stacks-peak": 0, "bytes-in": 1394517,
+                 "bytes-out": 401208, "write-ms": 3,
+                 "cpus": [ { "cpu": 0, "entries": 52114,
+                             "sample-drops": 0, "filter-drops": 0,
+                             "get-pc": 52031, "get-pc-slow": 12,
+                             "rw-debug": 0, "cache-hits": 0,
+                             "cache-misses": 0,
+                             "cache-coherence": 0 } ] } }
+
+EQMP
+
 SQMP
 query-migrate
 -------------
@@ -755,6 +755,13 @@ typedef struct CPUX86State {
     XMMReg ymmh_regs[CPU_NB_REGS];
 
     uint64_t xcr0;
+
+    /* mtrace: instructions started by this CPU, counted per TB */
+    uint64_t mtrace_insn_count;
+    /* the TB that last added to it, and whether the count has been
+       rewound since for abandoning that TB part way through */
+    struct TranslationBlock *mtrace_tb;
+    int mtrace_insn_rewound;
 } CPUX86State;
 
 CPUX86State *cpu_x86_init(const char *cpu_model);
@@ -221,6 +221,5 @@ DEF_HELPER_2(rcrq, tl, tl, tl)
 DEF_HELPER_0(mtrace_inst_exec, void)
 DEF_HELPER_2(mtrace_inst_call, void, tl, tl)
 DEF_HELPER_1(mtrace_inst_ret, void, tl)
-DEF_HELPER_0(mtrace_insn_count, void)
 
 #include "def-helper.h"
@@ -77,6 +77,44 @@ static uint8_t gen_opc_cc_op[OPC_BUF_SIZE];
 
 #include "gen-icount.h"
 
+/* mtrace instruction counting.  Like gen_icount_start, this adds the
+   TB's instruction count to env->mtrace_insn_count on entry to the TB
+   and fixes up the immediate once the count is known.  It also records
+   the TB in env->mtrace_tb, so an exception raised part way through
+   can take back the instructions that didn't finish (see
+   mtrace_tb_abort). */
+static TCGArg *mtrace_count_arg;
+
+static inline void gen_mtrace_count_start(TranslationBlock *tb)
+{
+    TCGv_i64 count;
+    TCGv_ptr tb_ptr;
+
+    if (!mtrace_system_enable_get())
+        return;
+
+    count = tcg_temp_new_i64();
+    tcg_gen_ld_i64(count, cpu_env, offsetof(CPUState, mtrace_insn_count));
+    mtrace_count_arg = gen_opparam_ptr + 1;
+    tcg_gen_addi_i64(count, count, 0xdeadbeef);
+    tcg_gen_st_i64(count, cpu_env, offsetof(CPUState, mtrace_insn_count));
+    tcg_temp_free_i64(count);
+
+    tb_ptr = tcg_const_ptr((tcg_target_long)tb);
+#if TCG_TARGET_REG_BITS == 32
+    tcg_gen_st_i32(tb_ptr, cpu_env, offsetof(CPUState, mtrace_tb));
+#else
+    tcg_gen_st_i64(tb_ptr, cpu_env, offsetof(CPUState, mtrace_tb));
+#endif
+    tcg_temp_free_ptr(tb_ptr);
+}
+
+static inline void gen_mtrace_count_end(int num_insns)
+{
+    if (mtrace_system_enable_get())
+        *mtrace_count_arg = num_insns;
+}
+
 #ifdef TARGET_X86_64
 static int x86_64_hregs;
 #endif
@@ -4194,9 +4232,6 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
     if (prefixes & PREFIX_LOCK)
         gen_helper_lock();
 
-    if (mtrace_system_enable_get())
-	gen_helper_mtrace_insn_count();
-
     /* now check op code */
  reswitch:
     switch(b) {
@@ -4614,7 +4649,8 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
             if (s->dflag == 0)
                 gen_op_andl_T0_ffff();
             next_eip = s->pc - s->cs_base;
-	    gen_helper_mtrace_inst_call(cpu_T[0], tcg_const_i64(next_eip));
+	    if (mtrace_instrument_get())
+		gen_helper_mtrace_inst_call(cpu_T[0], tcg_const_i64(next_eip));
             gen_movtl_T1_im(next_eip);
             gen_push_T1(s);
             gen_op_jmp_T0();
@@ -5303,6 +5339,12 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
             gen_op_mov_TN_reg(ot, 1, rm);
             gen_op_mov_reg_T0(ot, rm);
             gen_op_mov_reg_T1(ot, reg);
+	    if (reg == R_EBX && rm == R_EBX) {
+		/* mtrace may flush the TB cache to switch instrumentation,
+		   so end the TB right after the magic instruction */
+		gen_jmp_im(s->pc - s->cs_base);
+		gen_eob(s);
+	    }
         } else {
             gen_lea_modrm(s, modrm, &reg_addr, &offset_addr);
             gen_op_mov_TN_reg(ot, 0, reg);
@@ -6182,7 +6224,8 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
         gen_pop_update(s);
         if (s->dflag == 0)
             gen_op_andl_T0_ffff();
-	gen_helper_mtrace_inst_ret(cpu_T[0]);
+	if (mtrace_instrument_get())
+	    gen_helper_mtrace_inst_ret(cpu_T[0]);
         gen_op_jmp_T0();
         gen_eob(s);
         break;
@@ -6252,8 +6295,9 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
                 tval &= 0xffff;
             else if(!CODE64(s))
                 tval &= 0xffffffff;
-	    gen_helper_mtrace_inst_call(tcg_const_i64(tval), 
-					tcg_const_i64(next_eip));
+	    if (mtrace_instrument_get())
+		gen_helper_mtrace_inst_call(tcg_const_i64(tval), 
+					    tcg_const_i64(next_eip));
             gen_movtl_T0_im(next_eip);
             gen_push_T0(s);
             gen_jmp(s, tval);
@@ -7734,6 +7778,7 @@ static inline void gen_intermediate_code_internal(CPUState *env,
     target_ulong cs_base;
     int num_insns;
     int max_insns;
+    int gen_pc;
 
     /* generate intermediate code */
     pc_start = tb->pc;
@@ -7802,12 +7847,15 @@ static inline void gen_intermediate_code_internal(CPUState *env,
     dc->is_jmp = DISAS_NEXT;
     pc_ptr = pc_start;
     lj = -1;
+    /* mtrace needs the instruction starts to build the TB's PC map */
+    gen_pc = search_pc || mtrace_instrument_get();
     num_insns = 0;
     max_insns = tb->cflags & CF_COUNT_MASK;
     if (max_insns == 0)
         max_insns = CF_COUNT_MASK;
 
     gen_icount_start();
+    gen_mtrace_count_start(tb);
     for(;;) {
         if (unlikely(!QTAILQ_EMPTY(&env->breakpoints))) {
             QTAILQ_FOREACH(bp, &env->breakpoints, entry) {
@@ -7818,7 +7866,7 @@ static inline void gen_intermediate_code_internal(CPUState *env,
                 }
             }
         }
-        if (search_pc) {
+        if (gen_pc) {
             j = gen_opc_ptr - gen_opc_buf;
             if (lj < j) {
                 lj++;
@@ -7866,9 +7914,10 @@ static inline void gen_intermediate_code_internal(CPUState *env,
     if (tb->cflags & CF_LAST_IO)
         gen_io_end();
     gen_icount_end(tb, num_insns);
+    gen_mtrace_count_end(num_insns);
     *gen_opc_ptr = INDEX_op_end;
     /* we don't forget to fill the last values */
-    if (search_pc) {
+    if (gen_pc) {
         j = gen_opc_ptr - gen_opc_buf;
         lj++;
         while (lj <= j)
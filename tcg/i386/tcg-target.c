@@ -1055,6 +1055,74 @@ static inline void tcg_out_tlb_load(TCGContext *s, int addrlo_idx,
     /* Save the guest address in the second argument register */
     tcg_out_mov(s, type, r1, addrlo);
 }
+
+/* Tell mtrace about the TLB hit at host address r0, guest address r1.
+   Clobbers every call-clobbered register except data_reg.  */
+static void tcg_out_mtrace(TCGContext *s, int data_reg, int mem_index,
+                           int s_bits, int is_st, tcg_target_long func)
+{
+#if TCG_TARGET_REG_BITS == 64
+    const int r0 = tcg_target_call_iarg_regs[0];
+    const int r1 = tcg_target_call_iarg_regs[1];
+    int t0 = (data_reg == TCG_REG_RAX ? TCG_REG_R10 : TCG_REG_RAX);
+    int t1 = (data_reg == TCG_REG_RCX ? TCG_REG_R11 : TCG_REG_RCX);
+    uint8_t *label_ptr[2];
+#endif
+
+    switch (mtrace_instrument_get()) {
+    case mtrace_instrument_none:
+        return;
+#if TCG_TARGET_REG_BITS == 64
+    case mtrace_instrument_filter:
+        /* t0 = env->mtrace_cline_tlb[mem_index][TLB index of r1] */
+        tcg_out_mov(s, TCG_TYPE_I64, t0, r1);
+        tcg_out_shifti(s, SHIFT_SHR + P_REXW, t0, TARGET_PAGE_BITS - 3);
+        tgen_arithi(s, ARITH_AND + P_REXW, t0, (CPU_TLB_SIZE - 1) << 3, 0);
+        tcg_out_modrm_sib_offset(s, OPC_MOVL_GvEv + P_REXW, t0, TCG_AREG0,
+                                 t0, 0,
+                                 offsetof(CPUState,
+                                          mtrace_cline_tlb[mem_index][0]));
+
+        /* movzbl (t0,r0>>mtrace_cline_shift), t1 */
+        tcg_out_mov(s, TCG_TYPE_I64, t1, r0);
+        tcg_out_shifti(s, SHIFT_SHR + P_REXW, t1, mtrace_cline_shift);
+        tcg_out_modrm_sib_offset(s, OPC_MOVZBL, t1, t0, t1, 0, 0);
+
+        /* Loads only need a copy of the line, stores need the only
+           copy.  Either way, compare with env->mtrace_cline_mask.
+           With the owner encoding, shared lines always go out of
+           line.  */
+        if (!is_st && mtrace_cline_encoding_get() == mtrace_cline_bitmap) {
+            tcg_out_modrm_offset(s, OPC_TESTL, t1, TCG_AREG0,
+                                 offsetof(CPUState, mtrace_cline_mask));
+            tcg_out8(s, OPC_JCC_short + JCC_JE);
+        } else {
+            tcg_out_modrm_offset(s, OPC_CMP_GvEv, t1, TCG_AREG0,
+                                 offsetof(CPUState, mtrace_cline_mask));
+            tcg_out8(s, OPC_JCC_short + JCC_JNE);
+        }
+        label_ptr[0] = s->code_ptr;
+        s->code_ptr++;
+
+        /* The line didn't move, so only count the access */
+        tcg_out_movi(s, TCG_TYPE_PTR, t0, (tcg_target_long)&mtrace_access_count);
+        tcg_out_modrm_offset(s, OPC_GRP5 + P_REXW, EXT5_INC_Ev, t0, 0);
+        tcg_out8(s, OPC_JMP_short);
+        label_ptr[1] = s->code_ptr;
+        s->code_ptr++;
+
+        *label_ptr[0] = s->code_ptr - label_ptr[0] - 1;
+        tcg_out_movi(s, TCG_TYPE_I32, tcg_target_call_iarg_regs[2], 1<<s_bits);
+        tcg_out_calli(s, func);
+        *label_ptr[1] = s->code_ptr - label_ptr[1] - 1;
+        return;
+#endif
+    default:
+        tcg_out_movi(s, TCG_TYPE_I32, tcg_target_call_iarg_regs[2], 1<<s_bits);
+        tcg_out_calli(s, func);
+        return;
+    }
+}
 #endif
 
 static void tcg_out_qemu_ld_direct(TCGContext *s, int datalo, int datahi,
@@ -1165,9 +1233,9 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
     tcg_out_qemu_ld_direct(s, data_reg, data_reg2,
                            tcg_target_call_iarg_regs[0], 0, opc);
 
-    /* Tell mtrace */
-    tcg_out_movi(s, TCG_TYPE_I32, tcg_target_call_iarg_regs[2], 1<<s_bits);
-    tcg_out_calli(s, (tcg_target_long)mtrace_tcg_ld);
+    /* Tell mtrace (only while it is recording, see mtrace_instrument_set) */
+    tcg_out_mtrace(s, data_reg, mem_index, s_bits, 0,
+                   (tcg_target_long)mtrace_tcg_ld);
 
     /* jmp label2 */
     tcg_out8(s, OPC_JMP_short);
@@ -1344,9 +1412,9 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     tcg_out_qemu_st_direct(s, data_reg, data_reg2,
                            tcg_target_call_iarg_regs[0], 0, opc);
 
-    /* Tell mtrace */
-    tcg_out_movi(s, TCG_TYPE_I32, tcg_target_call_iarg_regs[2], 1<<s_bits);
-    tcg_out_calli(s, (tcg_target_long)mtrace_tcg_st);
+    /* Tell mtrace (only while it is recording, see mtrace_instrument_set) */
+    tcg_out_mtrace(s, data_reg, mem_index, s_bits, 1,
+                   (tcg_target_long)mtrace_tcg_st);
 
     /* jmp label2 */
     tcg_out8(s, OPC_JMP_short);
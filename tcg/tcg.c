@@ -57,6 +57,7 @@
 #include "exec-all.h"
 
 #include "tcg-op.h"
+#include "mtrace.h"
 #include "elf.h"
 
 #if defined(CONFIG_USE_GUEST_BASE) && !defined(TCG_TARGET_HAS_GUEST_BASE)
@@ -2012,6 +2013,8 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
 
     for(;;) {
         opc = gen_opc_buf[op_index];
+        /* host code offset of each op, used to build the TB's PC map */
+        gen_opc_code_off[op_index] = s->code_ptr - gen_code_buf;
 #ifdef CONFIG_PROFILER
         tcg_table_op_count[opc]++;
 #endif
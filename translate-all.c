@@ -30,6 +30,7 @@
 #include "disas.h"
 #include "tcg.h"
 #include "qemu-timer.h"
+#include "mtrace.h"
 
 /* code generation context */
 TCGContext tcg_ctx;
@@ -40,6 +41,7 @@ TCGArg gen_opparam_buf[OPPARAM_BUF_SIZE];
 target_ulong gen_opc_pc[OPC_BUF_SIZE];
 uint16_t gen_opc_icount[OPC_BUF_SIZE];
 uint8_t gen_opc_instr_start[OPC_BUF_SIZE];
+uint16_t gen_opc_code_off[OPC_BUF_SIZE];
 
 void cpu_gen_init(void)
 {
@@ -48,6 +50,31 @@ void cpu_gen_init(void)
                   CPU_TEMP_BUF_NLONGS * sizeof(long));
 }
 
+/* Build the host code offset to guest PC map for 'tb' from the
+   instruction starts recorded during translation.  The map is stored
+   in the code buffer right after the generated code, so it goes away
+   with the code on tb_flush.  */
+static void cpu_gen_pc_map(TranslationBlock *tb, int gen_code_size)
+{
+    TBPCMapEntry *map;
+    int i, n, nb_ops;
+
+    map = (TBPCMapEntry *)(((unsigned long)tb->tc_ptr + gen_code_size +
+                            sizeof(TBPCMapEntry) - 1) &
+                           ~(sizeof(TBPCMapEntry) - 1));
+    nb_ops = gen_opc_ptr - gen_opc_buf;
+    n = 0;
+    for (i = 0; i < nb_ops; i++) {
+        if (!gen_opc_instr_start[i])
+            continue;
+        map[n].code_off = gen_opc_code_off[i];
+        map[n].pc_off = gen_opc_pc[i] - tb->pc;
+        n++;
+    }
+    tb->pc_map = map;
+    tb->pc_map_len = n;
+}
+
 /* return non zero if the very first instruction is invalid so that
    the virtual CPU can trigger an exception.
 
@@ -92,6 +119,10 @@ int cpu_gen_code(CPUState *env, TranslationBlock *tb, int *gen_code_size_ptr)
 #endif
     gen_code_size = tcg_gen_code(s, gen_code_buf);
     *gen_code_size_ptr = gen_code_size;
+    if (mtrace_instrument_get())
+        cpu_gen_pc_map(tb, gen_code_size);
+    else
+        tb->pc_map = NULL;
 #ifdef CONFIG_PROFILER
     s->code_time += profile_getclock();
     s->code_in_len += tb->size;
@@ -156,6 +187,13 @@ int cpu_restore_state(TranslationBlock *tb,
     while (gen_opc_instr_start[j] == 0)
         j--;
     env->icount_decr.u16.low -= gen_opc_icount[j];
+    /* mtrace counted the whole TB on entry, but only the instructions
+       before this one have finished; it will be executed (and counted)
+       again */
+    if (mtrace_system_enable_get()) {
+        env->mtrace_insn_count -= tb->icount - gen_opc_icount[j];
+        env->mtrace_insn_rewound = 1;
+    }
 
     gen_pc_load(env, tb, searched_pc, j, puc);
 
@@ -165,3 +203,48 @@ int cpu_restore_state(TranslationBlock *tb,
 #endif
     return 0;
 }
+
+/* Return the guest PC of the instruction containing 'searched_pc',
+   using the map built at translation time instead of retranslating,
+   and its index in the TB in '*insn'.  'tb' must have a PC map.  */
+target_ulong tb_pc_map_lookup(TranslationBlock *tb, unsigned long searched_pc,
+                              int *insn)
+{
+    unsigned long off = searched_pc - (unsigned long)tb->tc_ptr;
+    int lo, hi, mid;
+
+    /* find the last instruction whose code starts at or before off */
+    lo = 0;
+    hi = tb->pc_map_len;
+    while (hi - lo > 1) {
+        mid = (lo + hi) / 2;
+        if (tb->pc_map[mid].code_off <= off)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    *insn = lo;
+    return tb->pc + tb->pc_map[lo].pc_off;
+}
+
+/* Return the index in 'tb' of the instruction at guest 'pc', or -1 if
+   there is none.  Retranslates 'tb' if it has no PC map.  */
+int tb_find_insn(CPUState *env, TranslationBlock *tb, target_ulong pc)
+{
+    int i, nb_ops;
+
+    if (tb->pc_map) {
+        for (i = 0; i < tb->pc_map_len; i++)
+            if (tb->pc + tb->pc_map[i].pc_off == pc)
+                return i;
+        return -1;
+    }
+
+    tcg_func_start(&tcg_ctx);
+    gen_intermediate_code_pc(env, tb);
+    nb_ops = gen_opc_ptr - gen_opc_buf;
+    for (i = 0; i < nb_ops; i++)
+        if (gen_opc_instr_start[i] && gen_opc_pc[i] == pc)
+            return gen_opc_icount[i];
+    return -1;
+}
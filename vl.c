@@ -2770,11 +2770,98 @@ int main(int argc, char **argv, char **envp)
 		mtrace_call_trace_set(1);
 		break;
 	    case QEMU_OPTION_mtrace_sample:
-		mtrace_sample_set(atoi(optarg));
+		if (mtrace_sample_parse(optarg)) {
+		    fprintf(stderr, "qemu: invalid mtrace sample: %s\n", optarg);
+		    exit(1);
+		}
 		break;
 	    case QEMU_OPTION_mtrace_quantum:
 		mtrace_quantum_set(atoi(optarg));
 		break;
+	    case QEMU_OPTION_mtrace_compress: {
+		char *end;
+		long level = strtol(optarg, &end, 10);
+		if (*end || level < 0 || level > 9) {
+		    fprintf(stderr, "qemu: invalid mtrace compression level: "
+			    "%s\n", optarg);
+		    exit(1);
+		}
+		mtrace_compress_set(level);
+		break;
+	    }
+	    case QEMU_OPTION_mtrace_format: {
+		char *end;
+		long format = strtol(optarg, &end, 10);
+		if (*end || format < 1 || format > 6) {
+		    fprintf(stderr, "qemu: invalid mtrace log format: %s\n",
+			    optarg);
+		    exit(1);
+		}
+		mtrace_format_set(format);
+		break;
+	    }
+	    case QEMU_OPTION_mtrace_buffer: {
+		int64_t value = strtosz_suffix(optarg, NULL,
+					       STRTOSZ_DEFSUFFIX_B);
+		if (value <= 0) {
+		    fprintf(stderr, "qemu: invalid mtrace buffer size: %s\n",
+			    optarg);
+		    exit(1);
+		}
+		mtrace_buffer_set(value);
+		break;
+	    }
+	    case QEMU_OPTION_mtrace_segment: {
+		int64_t value = strtosz_suffix(optarg, NULL,
+					       STRTOSZ_DEFSUFFIX_B);
+		if (value <= 0) {
+		    fprintf(stderr, "qemu: invalid mtrace segment size: %s\n",
+			    optarg);
+		    exit(1);
+		}
+		mtrace_segment_set(value);
+		break;
+	    }
+	    case QEMU_OPTION_mtrace_cache: {
+		char *end;
+		long ways = 8;
+		int64_t value = strtosz_suffix(optarg, &end,
+					       STRTOSZ_DEFSUFFIX_B);
+		if (value > 0 && *end == ',')
+		    ways = strtol(end + 1, &end, 10);
+		if (value <= 0 || *end || mtrace_cache_set(value, ways)) {
+		    fprintf(stderr, "qemu: invalid mtrace cache: %s\n", optarg);
+		    exit(1);
+		}
+		break;
+	    }
+	    case QEMU_OPTION_mtrace_filter:
+		if (mtrace_filter_parse(optarg)) {
+		    fprintf(stderr, "qemu: invalid mtrace filter: %s\n", optarg);
+		    exit(1);
+		}
+		break;
+	    case QEMU_OPTION_mtrace_granularity: {
+		int64_t value = strtosz_suffix(optarg, NULL,
+					       STRTOSZ_DEFSUFFIX_B);
+		if (value <= 0 || mtrace_granularity_set(value)) {
+		    fprintf(stderr, "qemu: invalid mtrace granularity: %s\n",
+			    optarg);
+		    exit(1);
+		}
+		break;
+	    }
+	    case QEMU_OPTION_mtrace_stats: {
+		char *end;
+		long seconds = strtol(optarg, &end, 10);
+		if (*end || seconds < 0 || seconds > INT_MAX / 1000) {
+		    fprintf(stderr, "qemu: invalid mtrace stats interval: %s\n",
+			    optarg);
+		    exit(1);
+		}
+		mtrace_stats_interval_set(seconds);
+		break;
+	    }
             default:
                 os_parse_cmd_args(popt->index, optarg);
             }